@@ -29,6 +29,73 @@ constexpr int max_backtrace_count = 20;
 
 constexpr std::chrono::seconds table_expires_after {1800};
 
+// Lifetime of NAPT bindings by protocol, as recommended in RFC 6146, ports
+// tried to find free one for new binding, and bindings held at most.
+constexpr std::chrono::seconds napt_tcp_expires_after  {7440};
+constexpr std::chrono::seconds napt_udp_expires_after  {300};
+constexpr std::chrono::seconds napt_icmp_expires_after {60};
+constexpr std::size_t          napt_port_probes  = 256;
+constexpr std::size_t          napt_max_bindings = 1 << 20;
+
+// Slots of the wheel which expires NAT entries, and entries checked at most
+// in single tick of the wheel.
+constexpr std::size_t table_wheel_slots   = 64;
+constexpr std::size_t table_expire_budget = 256;
+
+// Slots of per-thread cache of translated headers, which should be power of
+// two, and how long a slot is used without looking up the table again.
+constexpr std::size_t          flow_cache_slots = 1024;
+constexpr std::chrono::seconds flow_cache_lifetime {10};
+static_assert((flow_cache_slots & (flow_cache_slots - 1)) == 0, "flow_cache_slots should be power of two");
+
+// Pref64 prefixes configured at most, whose index is kept in each binding.
+constexpr std::size_t max_pref64 = 256;
+
+// Stateless v4 pools configured at most, and weight of each of them at most.
+constexpr std::size_t   max_v4pools       = 64;
+constexpr std::uint32_t max_v4pool_weight = 256;
+
+// Independently locked parts of NAT table, which should be power of two.
+constexpr std::size_t table_shards = 16;
+static_assert((table_shards & (table_shards - 1)) == 0, "table_shards should be power of two");
+
+// Same as MAX_TAP_QUEUES in linux/drivers/net/tun.c
+constexpr std::size_t max_tuntap_queues = 256;
+
+// Egress batch is flushed when either limit is reached, or ingress is drained.
+constexpr std::size_t egress_batch_depth = 64;
+constexpr std::size_t egress_batch_bytes = 256 * 1024;
+
+// AF_XDP UMEM geometry for each queue. Half of frames are used for RX, and
+// the rest for TX.
+constexpr std::size_t xsk_frame_size  = 2048;
+constexpr std::size_t xsk_frame_count = 4096;
+constexpr std::size_t xsk_ring_size   = 2048;
+
+// Packets processed from a ready descriptor before the reactor turns to others.
+constexpr std::size_t reactor_budget = 64;
+
+// Interval to retry flushing egress which is backlogged by transient failure,
+// e.g. ENOBUFS. Ingress is not read meanwhile.
+constexpr std::chrono::milliseconds egress_retry_interval {1};
+
+// Interval to report time spent spinning and sleeping in busy-poll mode.
+constexpr std::chrono::seconds reactor_report_interval {10};
+
+// Packet buffers in the pool for each worker, and ones moved at once between
+// the pool and a per-thread cache.
+constexpr std::size_t packet_pool_slots = 256;
+constexpr std::size_t packet_pool_batch = 32;
+
+constexpr std::size_t hugepage_size = 2 * 1024 * 1024;
+
+// Room in front of read packet, so that IPv4 header can be rewritten into
+// IPv6 header in place.
+constexpr std::size_t input_headroom = sizeof(ip6_hdr) - sizeof(ip);
+
+// Number of in-flight reads (and linked sends) on io_uring for each queue.
+constexpr std::size_t uring_depth = 64;
+
 } // namespace shinano::config
 
 inline constexpr std::uint8_t
@@ -44,6 +111,13 @@ reorder(std::uint32_t v) noexcept
          | (reorder(static_cast<std::uint16_t>(v      )) << 16);
 }
 
+inline constexpr std::uint64_t
+reorder(std::uint64_t v) noexcept
+{
+    return  reorder(static_cast<std::uint32_t>(v >> 32))
+         | (static_cast<std::uint64_t>(reorder(static_cast<std::uint32_t>(v))) << 32);
+}
+
 // XXX: Take care of endian by Boost.Predef
 template <typename T>
 inline constexpr T
@@ -0,0 +1,117 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_detail_bitmap_pool_hpp_
+#define shinano_detail_bitmap_pool_hpp_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/assert.hpp>
+
+namespace shinano { namespace detail {
+
+// Allocator of indices in [0, size), which is a bitmap placed on an area given
+// by user like bucket_map. Each word of upper levels summarises 64 words of
+// the lower level, whose bit is set if the word is full, so that a free index
+// is found by single ctz on each level. Zero filled area has every index free.
+struct bitmap_pool
+{
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    // Bytes of the area for `size` indices.
+    static std::size_t
+    footprint(std::size_t size) noexcept
+    {
+        std::size_t words = 0;
+        for (auto n = size; ; )
+        {
+            n = (n + 63) / 64;
+            words += n;
+            if (n <= 1) { break; }
+        }
+        return words * sizeof(std::uint64_t);
+    }
+
+    bitmap_pool() noexcept : depth(0) { }
+
+    // `area` should be zero filled if `fresh`, or attached with same size
+    // before.
+    bitmap_pool(void *area, std::size_t size, bool fresh) noexcept
+      : depth(0)
+    {
+        auto p = static_cast<std::uint64_t *>(area);
+        for (auto n = size; ; )
+        {
+            BOOST_ASSERT(depth < max_depth);
+            const auto words = (n + 63) / 64;
+            levels[depth++] = p;
+
+            // Mark the rest of the last word full, which has no index.
+            if (fresh && n % 64) { p[words - 1] = ~std::uint64_t(0) << (n % 64); }
+            p += words;
+            if (words <= 1) { break; }
+            n = words;
+        }
+    }
+
+    // Returns npos if every index is used.
+    std::size_t
+    allocate() noexcept
+    {
+        if (~levels[depth - 1][0] == 0) { return npos; }
+
+        std::size_t i = 0;
+        for (auto l = depth; l-- > 0; )
+        {
+            i = i * 64 + __builtin_ctzll(~levels[l][i]);
+        }
+        take(i);
+        return i;
+    }
+
+    // Mark free index `i` used.
+    void
+    take(std::size_t i) noexcept
+    {
+        BOOST_ASSERT(!used(i));
+        for (std::size_t l = 0; l < depth; ++l, i /= 64)
+        {
+            auto &w = levels[l][i / 64];
+            w |= std::uint64_t(1) << (i % 64);
+            if (~w != 0) { return; }
+        }
+    }
+
+    void
+    free(std::size_t i) noexcept
+    {
+        BOOST_ASSERT(used(i));
+        for (std::size_t l = 0; l < depth; ++l, i /= 64)
+        {
+            auto &w = levels[l][i / 64];
+            const bool full = ~w == 0;
+            w &= ~(std::uint64_t(1) << (i % 64));
+            if (!full) { return; }
+        }
+    }
+
+    bool
+    used(std::size_t i) const noexcept
+    {
+        return levels[0][i / 64] & (std::uint64_t(1) << (i % 64));
+    }
+
+private:
+    // Enough for 2^32 indices.
+    static constexpr std::size_t max_depth = 6;
+
+    std::uint64_t * levels[max_depth]; // from the leaves
+    std::size_t     depth;
+};
+
+} } // namespace shinano::detail
+
+#endif
@@ -0,0 +1,204 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_detail_bucket_map_hpp_
+#define shinano_detail_bucket_map_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "detail/siphash.hpp"
+
+#include <boost/assert.hpp>
+
+namespace shinano { namespace detail {
+
+// Open addressing hash map from trivially copyable keys to 32-bit values,
+// which is placed on an area given by user, e.g. shared memory. Whole state
+// including the hash key lives in the area, so that the map can be attached
+// again later, even by another process. Zero filled area is an empty map,
+// then fresh mapping needs no initialisation, and its pages are populated
+// only as the map is used.
+//
+// Each bucket fills single cache line, so that a lookup usually touches only
+// one line. Buckets are probed linearly, and erased slots are left as
+// tombstones until they are purged.
+template <typename Key>
+struct bucket_map
+{
+    static_assert(std::is_trivially_copyable<Key>::value, "key should be trivially copyable");
+
+    using value_type = std::uint32_t;
+
+    // 0 and values above are reserved for slot state.
+    static constexpr value_type max_value = 0xfffffffeu;
+
+    // Bytes of the area to hold `capacity` entries.
+    static std::size_t
+    footprint(std::size_t capacity) noexcept
+    {
+        return sizeof(header) + buckets_for(capacity) * sizeof(bucket);
+    }
+
+    bucket_map() noexcept : state(nullptr), buckets(nullptr) { }
+
+    // `area` of footprint(capacity) bytes should be aligned to cache line,
+    // and either zero filled or attached with same capacity before.
+    bucket_map(void *area, std::size_t capacity)
+      : state(static_cast<header *>(area)), buckets(reinterpret_cast<bucket *>(state + 1))
+    {
+        if (state->count == 0)
+        {
+            state->hash  = siphash::make();
+            state->count = buckets_for(capacity);
+        }
+        BOOST_ASSERT(state->count == buckets_for(capacity));
+    }
+
+    std::size_t
+    size() const noexcept { return state->live; }
+
+    value_type *
+    find(const Key &key) noexcept
+    {
+        const auto mask = state->count - 1;
+        for (auto b = state->hash(&key, sizeof(key)) & mask; ; b = (b + 1) & mask)
+        {
+            auto &bk = buckets[b];
+            for (std::size_t i = 0; i < slots; ++i)
+            {
+                if (bk.values[i] == empty) { return nullptr; }
+                if (bk.values[i] != tombstone && equal(bk.keys[i], key)) { return &bk.values[i]; }
+            }
+        }
+    }
+
+    // `key` should not be in the map, which should hold less than its
+    // capacity.
+    void
+    insert(const Key &key, value_type value)
+    {
+        BOOST_ASSERT(value != empty && value <= max_value);
+        if ((state->live + state->dead + 1) * 4 > state->count * slots * 3) { purge(); }
+
+        auto slot = place(key);
+        if (*slot.second == tombstone) { --state->dead; }
+        *slot.second = value;
+        std::memcpy(slot.first, &key, sizeof(key));
+        ++state->live;
+    }
+
+    bool
+    erase(const Key &key) noexcept
+    {
+        auto v = find(key);
+        if (!v) { return false; }
+
+        *v = tombstone;
+        --state->live;
+        ++state->dead;
+        return true;
+    }
+
+private:
+    static constexpr value_type empty     = 0;
+    static constexpr value_type tombstone = 0xffffffffu;
+
+    static constexpr std::size_t cache_line = 64;
+    static constexpr std::size_t slots = (cache_line - 1) / (sizeof(Key) + sizeof(value_type));
+    static_assert(slots > 0, "key is too large for a bucket");
+
+    struct alignas(cache_line) header
+    {
+        siphash       hash;
+        std::uint64_t count; // of buckets, or 0 if the area is fresh
+        std::uint64_t live;
+        std::uint64_t dead;
+    };
+
+    // Aligned, so that a bucket never straddles two lines.
+    struct alignas(cache_line) bucket
+    {
+        value_type values[slots];
+        Key        keys[slots];
+    };
+    static_assert(sizeof(bucket) == cache_line, "bucket should fill a cache line");
+
+    // Capacity is kept within 2/3 of slots, so that tombstones are purged
+    // after at least 1/12 of slots are erased.
+    static std::size_t
+    buckets_for(std::size_t capacity) noexcept
+    {
+        std::size_t n = 1;
+        while (n * slots * 2 < capacity * 3) { n *= 2; }
+        return n;
+    }
+
+    static bool
+    equal(const Key &a, const Key &b) noexcept { return std::memcmp(&a, &b, sizeof(Key)) == 0; }
+
+    // First free slot on the probe sequence of `key`.
+    std::pair<Key *, value_type *>
+    place(const Key &key) noexcept
+    {
+        const auto mask = state->count - 1;
+        for (auto b = state->hash(&key, sizeof(key)) & mask; ; b = (b + 1) & mask)
+        {
+            auto &bk = buckets[b];
+            for (std::size_t i = 0; i < slots; ++i)
+            {
+                if (bk.values[i] == empty || bk.values[i] == tombstone)
+                {
+                    return {&bk.keys[i], &bk.values[i]};
+                }
+            }
+        }
+    }
+
+    // Drop tombstones in place, since this runs under the caller's lock.
+    // Slots are visited in probe order from an empty one, i.e. the end of a
+    // cluster, and each live entry is placed again. An entry only moves back
+    // along its own probe sequence, then it never leaves a hole on the
+    // sequence of an entry placed before.
+    void
+    purge() noexcept
+    {
+        const auto total = state->count * slots;
+        std::size_t start = 0;
+        while (value_at(start) != empty) { ++start; }
+
+        for (std::size_t s = 0; s < total; ++s)
+        {
+            if (value_at(s) == tombstone) { value_at(s) = empty; }
+        }
+        state->dead = 0;
+
+        for (std::size_t n = 1; n <= total; ++n)
+        {
+            const auto s = (start + n) % total;
+            const auto v = value_at(s);
+            if (v == empty) { continue; }
+
+            const Key key = buckets[s / slots].keys[s % slots];
+            value_at(s) = empty;
+            auto slot = place(key);
+            *slot.second = v;
+            std::memcpy(slot.first, &key, sizeof(key));
+        }
+    }
+
+    value_type &
+    value_at(std::size_t s) noexcept { return buckets[s / slots].values[s % slots]; }
+
+    header * state;
+    bucket * buckets;
+};
+
+} } // namespace shinano::detail
+
+#endif
@@ -57,4 +57,28 @@ throw_with_errno()
     detail::throw_exception(ex);
 }
 
+send_error
+classify_send_error(int err) noexcept
+{
+    switch (err)
+    {
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+      case ENOBUFS:
+      case ENOMEM:
+      case EINTR:
+        return send_error::transient;
+
+      case EBADF:
+      case EFAULT:
+      case ENOTSOCK:
+      case EPIPE:
+      case EIO:
+        return send_error::fatal;
+    }
+    return send_error::packet;
+}
+
 } // namespace shinano
@@ -28,7 +28,7 @@ bool
 backtrace(throw_backtrace::value_type &) noexcept;
 
 template <typename E>
-inline void
+[[noreturn]] inline void
 throw_exception(E &&ex)
 {
     auto ei = boost::enable_error_info(ex);
@@ -47,6 +47,17 @@ throw_exception(E &&ex)
 void
 throw_with_errno();
 
+// How a failure of sending a packet affects the datapath.
+enum class send_error
+{
+    transient, // the packet may be sent later, e.g. ENOBUFS or EAGAIN
+    packet,    // only the packet is rejected, e.g. no route to host
+    fatal,     // the descriptor is unusable
+};
+
+send_error
+classify_send_error(int err) noexcept;
+
 } // namespace shinano
 
 #endif
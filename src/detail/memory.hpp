@@ -7,6 +7,10 @@
 #define shinano_detail_memory_hpp_
 
 #include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <sys/mman.h>
 
 namespace shinano { namespace detail {
 
@@ -24,6 +28,41 @@ struct free_delete
     }
 };
 
+struct raw_free
+{
+    void
+    operator()(void *p) const noexcept { std::free(p); }
+};
+
+// Owner of array of trivial objects, which is aligned to e.g. cache line.
+template <typename T>
+using aligned_array = std::unique_ptr<T[], raw_free>;
+
+template <typename T>
+inline aligned_array<T>
+make_aligned_array(std::size_t n, std::size_t align = alignof(T))
+{
+    static_assert(std::is_trivial<T>::value, "T should be trivial");
+
+    void *p = nullptr;
+    if (::posix_memalign(&p, align, n * sizeof(T)) != 0) { throw std::bad_alloc(); }
+    return aligned_array<T>(static_cast<T *>(p));
+}
+
+struct unmap_delete
+{
+    std::size_t length;
+
+    void
+    operator()(void *p) const noexcept
+    {
+        ::munmap(p, length);
+    }
+};
+
+// Owner of mmap(2)ed region.
+using mapping = std::unique_ptr<void, unmap_delete>;
+
 } } // namespace shinano::detail
 
 #endif
@@ -0,0 +1,145 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_detail_prefix_map_hpp_
+#define shinano_detail_prefix_map_hpp_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <netinet/in.h>
+
+#include <boost/assert.hpp>
+
+namespace shinano { namespace detail {
+
+// Map from IPv6 prefixes to 32-bit values, which finds the longest prefix
+// covering an address. Prefixes are put into open addressed slots by their
+// bits and length, and a lookup probes the slots once for each configured
+// length from the longest, so that it costs few probes regardless of the
+// number of prefixes. Only configured prefixes are in the slots, then remote
+// hosts can't make probes longer by their addresses.
+//
+// The map is built once and never changed afterward, then lookups need no
+// lock.
+struct prefix_map
+{
+    static constexpr std::uint32_t npos = 0xffffffffu;
+
+    prefix_map() noexcept : slot_shift(64) { }
+
+    // Room for `count` prefixes at most.
+    explicit
+    prefix_map(std::size_t count)
+    {
+        std::size_t n = 8;
+        slot_shift = 64 - 3;
+        while (n < count * 2) { n *= 2; --slot_shift; }
+        slots.assign(n, slot{{0, 0}, 0, npos});
+    }
+
+    // Bits after `plen` are ignored. Returns false if the prefix is given
+    // already.
+    bool
+    insert(const in6_addr &prefix, std::size_t plen, std::uint32_t value)
+    {
+        BOOST_ASSERT(plen <= 128 && value != npos);
+
+        auto m = std::find_if(masks.begin(), masks.end(), [&](const length_mask &l) { return l.plen <= plen; });
+        if (m == masks.end() || m->plen != plen) { m = masks.insert(m, length_mask{plen, mask_of(plen)}); }
+
+        const auto key = key_of(prefix, m->mask);
+        const auto mask = slots.size() - 1;
+        auto j = hash(key, plen);
+        for (; slots[j].value != npos; j = (j + 1) & mask)
+        {
+            if (slots[j].plen == plen && slots[j].key == key) { return false; }
+        }
+        slots[j] = slot{key, static_cast<std::uint32_t>(plen), value};
+        return true;
+    }
+
+    // Value of the longest prefix which covers `address`, or npos.
+    std::uint32_t
+    find(const in6_addr &address) const noexcept
+    {
+        const auto mask = slots.size() - 1;
+        for (const auto &m : masks)
+        {
+            const auto key = key_of(address, m.mask);
+            for (auto j = hash(key, m.plen); slots[j].value != npos; j = (j + 1) & mask)
+            {
+                if (slots[j].plen == m.plen && slots[j].key == key) { return slots[j].value; }
+            }
+        }
+        return npos;
+    }
+
+    // Whether bits of `address` after `plen` are all zero.
+    static bool
+    masked(const in6_addr &address, std::size_t plen) noexcept
+    {
+        return key_of(address, mask_of(plen)) == key_of(address, mask_of(128));
+    }
+
+private:
+    // Address in memory order, i.e. `hi` holds leading 64 bits, whose bits
+    // after a prefix are masked out.
+    struct prefix_key
+    {
+        std::uint64_t hi, lo;
+
+        friend bool
+        operator==(const prefix_key &a, const prefix_key &b) noexcept { return a.hi == b.hi && a.lo == b.lo; }
+    };
+
+    struct length_mask
+    {
+        std::size_t plen;
+        prefix_key  mask;
+    };
+
+    struct slot
+    {
+        prefix_key    key;
+        std::uint32_t plen;
+        std::uint32_t value; // or npos if empty
+    };
+
+    static prefix_key
+    key_of(const in6_addr &address, const prefix_key &mask) noexcept
+    {
+        std::uint64_t w[2];
+        std::memcpy(w, &address, sizeof(w));
+        return {w[0] & mask.hi, w[1] & mask.lo};
+    }
+
+    static prefix_key
+    mask_of(std::size_t plen) noexcept
+    {
+        in6_addr m = {};
+        std::fill_n(m.s6_addr, plen / 8, 0xff);
+        if (plen % 8) { m.s6_addr[plen / 8] = 0xff << (8 - plen % 8); }
+        return key_of(m, {~std::uint64_t(0), ~std::uint64_t(0)});
+    }
+
+    std::size_t
+    hash(const prefix_key &k, std::size_t plen) const noexcept
+    {
+        // Upper bits of product depend on every bit of the key.
+        const auto h = (k.hi ^ (k.lo * 0x9e3779b97f4a7c15ull) ^ plen) * 0xff51afd7ed558ccdull;
+        return h >> slot_shift;
+    }
+
+    std::vector<length_mask> masks; // from the longest
+    std::vector<slot>        slots;
+    unsigned                 slot_shift; // picks top bits of hash for the slot
+};
+
+} } // namespace shinano::detail
+
+#endif
@@ -0,0 +1,84 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_detail_siphash_hpp_
+#define shinano_detail_siphash_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+namespace shinano { namespace detail {
+
+// SipHash-1-3, keyed hash for hash tables whose keys are chosen by remote
+// hosts, e.g. addresses. Without knowing the key, nobody can craft keys which
+// collide into same bucket.
+struct siphash
+{
+    std::uint64_t k0, k1;
+
+    // Random key from the system.
+    static siphash
+    make()
+    {
+        std::random_device rd;
+        auto word = [&]
+        {
+            return (static_cast<std::uint64_t>(rd()) << 32) | rd();
+        };
+        const auto k0 = word();
+        return {k0, word()};
+    }
+
+    std::uint64_t
+    operator()(const void *data, std::size_t len) const noexcept
+    {
+        std::uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+        std::uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+        std::uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+        std::uint64_t v3 = k1 ^ 0x7465646279746573ull;
+
+        auto round = [&]
+        {
+            v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+            v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+            v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+            v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+        };
+
+        auto p = static_cast<const std::uint8_t *>(data);
+        const auto end = p + (len & ~std::size_t(7));
+        for (; p != end; p += 8)
+        {
+            std::uint64_t m;
+            std::memcpy(&m, p, sizeof(m));
+            v3 ^= m;
+            round();
+            v0 ^= m;
+        }
+
+        std::uint64_t b = static_cast<std::uint64_t>(len) << 56;
+        for (std::size_t i = 0; i < (len & 7); ++i)
+        {
+            b |= static_cast<std::uint64_t>(p[i]) << (8 * i);
+        }
+        v3 ^= b;
+        round();
+        v0 ^= b;
+
+        v2 ^= 0xff;
+        round(); round(); round();
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+private:
+    static std::uint64_t
+    rotl(std::uint64_t x, int b) noexcept { return (x << b) | (x >> (64 - b)); }
+};
+
+} } // namespace shinano::detail
+
+#endif
@@ -0,0 +1,314 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <linux/if_tun.h>
+
+#include "config.hpp"
+#include "egress.hpp"
+
+#include "detail/exception.hpp"
+
+#include "detail/designated_initializer.hpp"
+
+#include <boost/assert.hpp>
+
+namespace shinano {
+
+void
+egress::report(bool backlogged)
+{
+    if (backlogged == reported) { return; }
+    reported = backlogged;
+
+    const auto c = stats();
+    if (backlogged)
+    {
+        std::cerr << "warning: egress backlogged: " << std::strerror(errno) << std::endl;
+    }
+    else
+    {
+        std::cerr
+          << "info: egress recovered"
+          << " (retried " << c.retried << ", dropped " << c.dropped << ")"
+          << std::endl;
+    }
+}
+
+
+void
+raw_egress::forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+                    const virtio_net_hdr *, std::size_t)
+{
+    s.enqueue(iov, iovcnt, addr, addrlen);
+}
+
+void
+raw_egress::flush()
+{
+    s.flush();
+    report(s.backlogged());
+}
+
+
+tuntap_egress::tuntap_egress(tuntap &t)
+  : t(t)
+  , arena(config::egress_batch_bytes)
+  , spare(config::egress_batch_bytes)
+  , used(0)
+  , stalled(false)
+  , stat()
+{
+    pending.reserve(config::egress_batch_depth);
+}
+
+void
+tuntap_egress::forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t,
+                       const virtio_net_hdr *vnet, std::size_t headroom)
+{
+    const auto pi = designated((tun_pi)) by
+    (
+      ((.flags = 0))
+      ((.proto = static_cast<std::uint16_t>(addr->sa_family == AF_INET6
+                                            ? ieee::protocol_number::ipv6
+                                            : ieee::protocol_number::ip)))
+    );
+    const virtio_net_hdr none = {};
+    if (!vnet) { vnet = &none; }
+    const std::size_t prefix = sizeof(pi) + (t.has_vnet_hdr() ? sizeof(virtio_net_hdr) : 0);
+
+    std::size_t len = prefix;
+    for (int i = 0; i < iovcnt; ++i) { len += iov[i].iov_len; }
+    BOOST_ASSERT(len <= arena.size());
+
+    const bool inplace = (iovcnt == 1 && prefix <= headroom);
+    // Whether the queue is full even if first `n` packets are removed.
+    auto full = [&](std::size_t n, std::size_t used)
+    {
+        return pending.size() - n == config::egress_batch_depth
+            || (!inplace && used + len > arena.size());
+    };
+    if (full(0, used))
+    {
+        flush();
+
+        // Backlogged packets are all in the arena. Drop the oldest for room.
+        std::size_t n = 0;
+        for (auto u = used; full(n, u); ++n) { u -= pending[n].iov_len; }
+        if (n)
+        {
+            stat.dropped += n;
+            retain(n);
+        }
+    }
+
+    // Headers go in front of the packet, or the packet is copied into arena.
+    auto p = inplace ? static_cast<std::uint8_t *>(iov[0].iov_base) - prefix
+                     : arena.data() + used;
+    std::memcpy(p, &pi, sizeof(pi));
+    std::memcpy(p + sizeof(pi), vnet, prefix - sizeof(pi));
+    if (!inplace)
+    {
+        auto q = p + prefix;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            std::memcpy(q, iov[i].iov_base, iov[i].iov_len);
+            q += iov[i].iov_len;
+        }
+        used += len;
+    }
+
+    pending.push_back(iovec{p, len});
+}
+
+void
+tuntap_egress::flush()
+{
+    // TUN receives single packet per write.
+    std::size_t sent = 0;
+    stalled = false;
+    while (sent < pending.size() && !stalled)
+    {
+        if (::write(t.native(), pending[sent].iov_base, pending[sent].iov_len) >= 0)
+        {
+            ++sent;
+            continue;
+        }
+
+        switch (classify_send_error(errno))
+        {
+          case send_error::transient:
+            if (errno == EINTR) { continue; }
+            ++stat.retried;
+            stalled = true;
+            break;
+
+          case send_error::packet:
+            ++stat.dropped;
+            ++sent;
+            break;
+
+          case send_error::fatal:
+            pending.clear();
+            used = 0;
+            throw_with_errno();
+        }
+    }
+    report(stalled);
+
+    if (sent == pending.size())
+    {
+        pending.clear();
+        used = 0;
+        return;
+    }
+    retain(sent);
+}
+
+void
+tuntap_egress::retain(std::size_t first)
+{
+    // In-place packets are not counted in `used`, e.g. GSO packets, then the
+    // older ones are dropped until the rest fits into the spare.
+    auto keep = pending.size();
+    for (std::size_t bytes = 0; keep > first && bytes + pending[keep - 1].iov_len <= spare.size(); )
+    {
+        bytes += pending[--keep].iov_len;
+    }
+    stat.dropped += keep - first;
+
+    // Copy through the spare, since in-place packets may be anywhere.
+    std::size_t n = 0;
+    for (auto i = keep; i < pending.size(); ++i)
+    {
+        auto &v = pending[i];
+        std::memcpy(spare.data() + n, v.iov_base, v.iov_len);
+        v.iov_base = spare.data() + n;
+        n += v.iov_len;
+    }
+    pending.erase(pending.begin(), pending.begin() + keep);
+    arena.swap(spare);
+    used = n;
+}
+
+
+void
+xsk_egress::reply_to(const ether_header &in) noexcept
+{
+    std::memcpy(link.ether_dhost, in.ether_shost, sizeof(link.ether_dhost));
+    std::memcpy(link.ether_shost, in.ether_dhost, sizeof(link.ether_shost));
+}
+
+void
+xsk_egress::forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t,
+                    const virtio_net_hdr *, std::size_t)
+{
+    // for ethernet, ip, icmp, ip, icmp and payload
+    constexpr int max_iovcnt = 6;
+    BOOST_ASSERT(iovcnt < max_iovcnt);
+
+    auto eth = link;
+    eth.ether_type = static_cast<std::uint16_t>(addr->sa_family == AF_INET6
+                                                ? ieee::protocol_number::ipv6
+                                                : ieee::protocol_number::ip);
+
+    iovec eiov[max_iovcnt];
+    eiov[0].iov_base = &eth;
+    eiov[0].iov_len  = sizeof(eth);
+    std::copy(iov, iov + iovcnt, eiov + 1);
+
+    if (!s.transmit(eiov, iovcnt + 1))
+    {
+        std::cerr << "info: dropped: no room on AF_XDP TX" << std::endl;
+    }
+}
+
+void
+xsk_egress::flush()
+{
+    s.flush();
+}
+
+
+uring_egress::uring_egress(std::size_t depth, bool tuntap, bool vnet)
+  : slots(depth), current(nullptr), tuntap(tuntap), vnet(vnet)
+{
+    BOOST_ASSERT(tuntap || !vnet);
+    for (auto &s : slots)
+    {
+        s.bytes.resize(sizeof(tun_pi) + sizeof(virtio_net_hdr) + IP_MAXPACKET);
+        s.data = s.bytes.data();
+        s.len  = 0;
+        s.inplace = false;
+    }
+}
+
+void
+uring_egress::select(std::size_t i) noexcept
+{
+    current = &slots[i];
+    current->len = 0;
+}
+
+void
+uring_egress::forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+                      const virtio_net_hdr *offload, std::size_t headroom)
+{
+    BOOST_ASSERT(current);
+    auto &s = *current;
+
+    const auto pi = designated((tun_pi)) by
+    (
+      ((.flags = 0))
+      ((.proto = static_cast<std::uint16_t>(addr->sa_family == AF_INET6
+                                            ? ieee::protocol_number::ipv6
+                                            : ieee::protocol_number::ip)))
+    );
+    const virtio_net_hdr none = {};
+    if (!offload) { offload = &none; }
+    const std::size_t pi_len   = tuntap ? sizeof(pi) : 0;
+    const std::size_t vnet_len = vnet ? sizeof(virtio_net_hdr) : 0;
+
+    s.inplace = (iovcnt == 1 && pi_len + vnet_len <= headroom);
+    if (s.inplace)
+    {
+        s.data = static_cast<std::uint8_t *>(iov[0].iov_base) - pi_len - vnet_len;
+        s.len  = pi_len + vnet_len + iov[0].iov_len;
+        std::memcpy(s.data, &pi, pi_len);
+        std::memcpy(s.data + pi_len, offload, vnet_len);
+    }
+    else
+    {
+        s.data = s.bytes.data();
+
+        auto p = s.data;
+        std::memcpy(p, &pi, pi_len);
+        p += pi_len;
+        std::memcpy(p, offload, vnet_len);
+        p += vnet_len;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            BOOST_ASSERT(p + iov[i].iov_len <= s.bytes.data() + s.bytes.size());
+            std::memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        s.len = p - s.data;
+    }
+
+    std::memcpy(&s.name, addr, addrlen);
+    s.iov.iov_base = s.data;
+    s.iov.iov_len  = s.len;
+    s.msg = designated((msghdr)) by
+    (
+      ((.msg_name = &s.name))
+      ((.msg_namelen = addrlen))
+      ((.msg_iov = &s.iov))
+      ((.msg_iovlen = 1))
+    );
+}
+
+} // namespace shinano
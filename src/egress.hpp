@@ -0,0 +1,203 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_egress_hpp_
+#define shinano_egress_hpp_
+
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/ethernet.h>
+
+#include "socket.hpp"
+#include "virtio_net.hpp"
+
+namespace shinano {
+
+// Where translated packets go out.
+struct egress
+{
+    virtual
+    ~egress() = default;
+
+    // `vnet` is offload state of the packet, or nullptr if there is none.
+    // `headroom` bytes in front of iov[0] may be overwritten by the egress.
+    virtual void
+    forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+            const virtio_net_hdr *vnet, std::size_t headroom) = 0;
+
+    // Send any queued packet.
+    virtual void
+    flush() { }
+
+    // True if packets are left queued by transient failure, e.g. ENOBUFS.
+    // Ingress should not be read until flush succeeds.
+    virtual bool
+    backlogged() const { return false; }
+
+    struct counters
+    {
+        std::uint64_t retried; // flushes which left packets queued
+        std::uint64_t dropped; // packets dropped by failure or overflow
+    };
+
+    virtual counters
+    stats() const { return counters{}; }
+
+    template <typename A>
+    void
+    forward(const iovec *iov, int iovcnt, const A &addr,
+            const virtio_net_hdr *vnet = nullptr, std::size_t headroom = 0)
+    {
+        forward(iov, iovcnt, reinterpret_cast<const sockaddr *>(&addr), sizeof(A), vnet, headroom);
+    }
+
+protected:
+    // Log when the egress gets backlogged or recovers.
+    void
+    report(bool backlogged);
+
+private:
+    bool reported = false;
+};
+
+// Send through SOCK_RAW/IPPROTO_RAW socket, so that the kernel routes packets.
+// Offload state is not available, then packets should be fully checksummed.
+struct raw_egress : egress
+{
+    explicit
+    raw_egress(raw &s) noexcept : s(s) { }
+
+    virtual void
+    forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+            const virtio_net_hdr *vnet, std::size_t headroom) override;
+
+    virtual void
+    flush() override;
+
+    virtual bool
+    backlogged() const override { return s.backlogged(); }
+
+    virtual counters
+    stats() const override { return counters{s.retried(), s.dropped()}; }
+
+private:
+    raw &s;
+};
+
+// Write back into the TUN device with packet information header, so that the
+// kernel receives packets as ingress on the TUN and forwards them normally.
+// Single descriptor carries both directions. If the TUN has vnet_hdr, offload
+// state is written next to packet information.
+//
+// Packets are queued and written in a burst on flush, so that GRO on NAPI
+// enabled TUN can merge them. Packet rewritten in place is queued as is, then
+// the caller should keep its buffer until flush.
+//
+// Packets rejected by transient failure are copied into the arena and retried
+// on next flush; if the queue is full, the oldest ones are dropped.
+struct tuntap_egress : egress
+{
+    explicit
+    tuntap_egress(tuntap &t);
+
+    virtual void
+    forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+            const virtio_net_hdr *vnet, std::size_t headroom) override;
+
+    virtual void
+    flush() override;
+
+    virtual bool
+    backlogged() const override { return stalled; }
+
+    virtual counters
+    stats() const override { return stat; }
+
+private:
+    // Keep pending packets from `first` in the arena as far as they fit, and
+    // drop the rest.
+    void
+    retain(std::size_t first);
+
+    tuntap &t;
+
+    std::vector<std::uint8_t> arena;
+    std::vector<std::uint8_t> spare;
+    std::size_t               used;
+    std::vector<iovec>        pending;
+
+    bool     stalled;
+    counters stat;
+};
+
+// Transmit from AF_XDP socket. Translated frames are sent back to the peer who
+// sent the last received frame, i.e. the translator works as a one-armed
+// router on the interface.
+struct xsk_egress : egress
+{
+    explicit
+    xsk_egress(xsk &s) noexcept : s(s), link() { }
+
+    void
+    reply_to(const ether_header &in) noexcept;
+
+    virtual void
+    forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+            const virtio_net_hdr *vnet, std::size_t headroom) override;
+
+    virtual void
+    flush() override;
+
+private:
+    xsk &s;
+    ether_header link;
+};
+
+// Flatten translated packets into per-slot buffers for io_uring. A slot is
+// owned by single in-flight operation, so that the packet survives until its
+// completion. For TUN egress, packet information header is prepended, and
+// followed by virtio_net_hdr if `vnet`. Packet rewritten in place is sent from
+// the input buffer as is, which is not reused until the send completes.
+struct uring_egress : egress
+{
+    struct slot
+    {
+        std::vector<std::uint8_t> bytes;
+        std::uint8_t *   data;    // either bytes or the input buffer
+        std::size_t      len;
+        bool             inplace;
+        sockaddr_storage name;
+        iovec            iov;
+        msghdr           msg;
+    };
+
+    uring_egress(std::size_t depth, bool tuntap, bool vnet = false);
+
+    // Next translated packet goes into slot `i`.
+    void
+    select(std::size_t i) noexcept;
+
+    slot &
+    operator[](std::size_t i) noexcept { return slots[i]; }
+
+    bool
+    writes_tuntap() const noexcept { return tuntap; }
+
+    virtual void
+    forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+            const virtio_net_hdr *vnet, std::size_t headroom) override;
+
+private:
+    std::vector<slot> slots;
+    slot *current;
+    bool  tuntap;
+    bool  vnet;
+};
+
+} // namespace shinano
+
+#endif
@@ -0,0 +1,132 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <sys/mman.h>
+
+#include "config.hpp"
+#include "packet_pool.hpp"
+
+#include "detail/exception.hpp"
+
+#include <boost/assert.hpp>
+
+namespace shinano {
+
+namespace {
+
+constexpr std::size_t cache_line = 64;
+
+std::size_t
+round_up(std::size_t n, std::size_t unit) noexcept
+{
+    return (n + unit - 1) / unit * unit;
+}
+
+// Map `len` bytes on hugepages, or on normal pages with a hint for THP if no
+// hugepage is reserved.
+detail::mapping
+map_area(std::size_t len, bool &huge)
+{
+    const auto hlen = round_up(len, config::hugepage_size);
+    void *p = ::mmap(nullptr, hlen, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        huge = true;
+        return detail::mapping(p, detail::unmap_delete{hlen});
+    }
+
+    p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) { throw_with_errno(); }
+    // Not fatal; only TLB pressure is affected.
+    ::madvise(p, len, MADV_HUGEPAGE);
+
+    huge = false;
+    return detail::mapping(p, detail::unmap_delete{len});
+}
+
+} // namespace <anonymous>
+
+packet_pool::packet_pool(std::size_t slot_size, std::size_t count)
+  : size(round_up(slot_size, cache_line)), count(count), huge(false)
+{
+    area = map_area(size * count, huge);
+
+    free.resize(count);
+    for (std::size_t i = 0; i < count; ++i) { free[i] = count - i - 1; }
+}
+
+void
+packet_pool::take(std::vector<std::uint32_t> &to, std::size_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    n = std::min(n, free.size());
+    to.insert(to.end(), free.end() - n, free.end());
+    free.resize(free.size() - n);
+}
+
+void
+packet_pool::give(std::vector<std::uint32_t> &from, std::size_t n) noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // Never reallocates, since the shared list had room for every slot.
+    free.insert(free.end(), from.end() - n, from.end());
+    from.resize(from.size() - n);
+}
+
+void
+packet_pool::packet::reset() noexcept
+{
+    if (!pool) { return; }
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->free.push_back(index);
+    pool = nullptr;
+}
+
+
+packet_pool::cache::cache(packet_pool &pool)
+  : pool(pool)
+{
+    free.reserve(2 * config::packet_pool_batch);
+}
+
+packet_pool::cache::~cache() noexcept
+{
+    pool.give(free, free.size());
+}
+
+packet
+packet_pool::cache::acquire()
+{
+    if (free.empty())
+    {
+        pool.take(free, config::packet_pool_batch);
+        if (free.empty()) { return {}; }
+    }
+
+    const auto i = free.back();
+    free.pop_back();
+    return {&pool, i};
+}
+
+void
+packet_pool::cache::release(packet &&p)
+{
+    if (!p) { return; }
+    BOOST_ASSERT(p.pool == &pool);
+
+    // Keep a batch for the next acquire, and return the rest.
+    if (free.size() == 2 * config::packet_pool_batch)
+    {
+        pool.give(free, config::packet_pool_batch);
+    }
+    free.push_back(p.index);
+    p.pool = nullptr;
+}
+
+} // namespace shinano
@@ -0,0 +1,136 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_packet_pool_hpp_
+#define shinano_packet_pool_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "detail/memory.hpp"
+
+namespace shinano {
+
+// Fixed size packet buffers carved out of single mapping, which is backed by
+// 2 MB hugepages if available. Buffers are owned through `packet` handles, and
+// each thread takes them through its own `cache`, so that the shared free
+// list is locked only once per batch.
+struct packet_pool
+{
+    struct cache;
+
+    // Owner of single buffer, which can be moved to another thread without
+    // allocation. Destroyed handle returns its buffer to the shared free list;
+    // cache::release returns it to the thread instead.
+    struct packet
+    {
+        packet() noexcept : pool(nullptr), index(0) { }
+
+        packet(packet &&other) noexcept
+          : pool(other.pool), index(other.index)
+        {
+            other.pool = nullptr;
+        }
+
+        packet &
+        operator=(packet &&other) noexcept
+        {
+            reset();
+            std::swap(pool, other.pool);
+            index = other.index;
+            return *this;
+        }
+
+        ~packet() noexcept { reset(); }
+
+        explicit
+        operator bool() const noexcept { return pool; }
+
+        std::uint8_t *
+        data() const noexcept { return pool->slot(index); }
+
+        std::size_t
+        size() const noexcept { return pool->slot_size(); }
+
+        void
+        reset() noexcept;
+
+    private:
+        friend packet_pool;
+        friend cache;
+
+        packet(packet_pool *pool, std::uint32_t index) noexcept
+          : pool(pool), index(index) { }
+
+        packet_pool * pool;
+        std::uint32_t index;
+    };
+
+    // Per-thread free list. Not thread safe.
+    struct cache
+    {
+        explicit
+        cache(packet_pool &pool);
+
+        ~cache() noexcept;
+
+        cache(const cache &) = delete;
+        cache &operator=(const cache &) = delete;
+
+        // Returns empty handle if the pool is exhausted.
+        packet
+        acquire();
+
+        void
+        release(packet &&p);
+
+    private:
+        packet_pool &pool;
+        std::vector<std::uint32_t> free;
+    };
+
+    // Slot size is rounded up to cache line.
+    packet_pool(std::size_t slot_size, std::size_t count);
+
+    std::size_t
+    slot_size() const noexcept { return size; }
+
+    std::size_t
+    capacity() const noexcept { return count; }
+
+    bool
+    hugepage() const noexcept { return huge; }
+
+private:
+    std::uint8_t *
+    slot(std::uint32_t i) const noexcept
+    {
+        return static_cast<std::uint8_t *>(area.get()) + i * size;
+    }
+
+    // Move at most `n` indices between the shared free list and `to`.
+    void
+    take(std::vector<std::uint32_t> &to, std::size_t n);
+
+    void
+    give(std::vector<std::uint32_t> &from, std::size_t n) noexcept;
+
+    std::size_t     size;
+    std::size_t     count;
+    bool            huge;
+    detail::mapping area;
+
+    std::mutex                 mutex;
+    std::vector<std::uint32_t> free;
+};
+
+using packet = packet_pool::packet;
+
+} // namespace shinano
+
+#endif
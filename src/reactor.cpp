@@ -0,0 +1,119 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <sys/epoll.h>
+#include "config.hpp"
+#include "reactor.hpp"
+
+#include "detail/designated_initializer.hpp"
+#include "detail/exception.hpp"
+
+namespace shinano {
+
+reactor::reactor()
+  : safe_desc(::epoll_create1(EPOLL_CLOEXEC)), stat()
+{
+}
+
+void
+reactor::add(int fd, handler h)
+{
+    auto ev = designated((epoll_event)) by
+    (
+      ((.events = EPOLLIN))
+    );
+    ev.data.u64 = handlers.size();
+    if (::epoll_ctl(native(), EPOLL_CTL_ADD, fd, &ev) < 0) { throw_with_errno(); }
+
+    fds.push_back(fd);
+    handlers.push_back(std::move(h));
+    backlog.push_back(false);
+}
+
+void
+reactor::watch(std::size_t i, bool on)
+{
+    auto ev = designated((epoll_event)) by
+    (
+      ((.events = on ? EPOLLIN : 0u))
+    );
+    ev.data.u64 = i;
+    if (::epoll_ctl(native(), EPOLL_CTL_MOD, fds[i], &ev) < 0) { throw_with_errno(); }
+}
+
+void
+reactor::run(std::size_t budget, std::chrono::microseconds spin)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<epoll_event> events(handlers.size());
+
+    auto call = [&](std::size_t i)
+    {
+        const bool b = handlers[i](budget);
+        if (b != backlog[i]) { watch(i, !b); }
+        backlog[i] = b;
+    };
+
+    auto last_event  = clock::now();
+    auto last_report = last_event;
+    while (true)
+    {
+        const bool retry  = std::find(backlog.begin(), backlog.end(), true) != backlog.end();
+        const auto before = clock::now();
+        const bool block  = spin == spin.zero() || spin <= before - last_event;
+        const int timeout = !block ? 0
+                          : retry  ? static_cast<int>(config::egress_retry_interval.count())
+                          :          -1;
+
+        const int n = ::epoll_wait(native(), events.data(), events.size(), timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR) { continue; }
+            throw_with_errno();
+        }
+
+        const auto after = clock::now();
+        if (block)
+        {
+            stat.sleep += after - before;
+            ++stat.wakeups;
+        }
+        else if (n == 0)
+        {
+            stat.spin += after - before;
+        }
+        if (n > 0) { last_event = after; }
+
+        for (int i = 0; i < n; ++i)
+        {
+            call(events[i].data.u64);
+        }
+        if (retry)
+        {
+            for (std::size_t i = 0; i < handlers.size(); ++i)
+            {
+                if (backlog[i]) { call(i); }
+            }
+        }
+
+        if (spin != spin.zero() && config::reactor_report_interval <= after - last_report)
+        {
+            using std::chrono::duration_cast;
+            using std::chrono::milliseconds;
+            std::cout
+              << "info: busy-poll: spin " << duration_cast<milliseconds>(stat.spin).count() << " ms"
+              << ", sleep " << duration_cast<milliseconds>(stat.sleep).count() << " ms"
+              << " (" << stat.wakeups << " wakeups)"
+              << std::endl;
+            stat = counters{};
+            last_report = after;
+        }
+    }
+}
+
+} // namespace shinano
@@ -0,0 +1,65 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_reactor_hpp_
+#define shinano_reactor_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "socket.hpp"
+
+namespace shinano {
+
+// Level-triggered epoll loop, which serves any number of nonblocking
+// descriptors on single thread. Handler of ready descriptor is given a budget,
+// i.e. how many packets it may process in this turn, so that a busy descriptor
+// never starves others. Unprocessed packets are reported again in next turn.
+//
+// Handler returns true if it is backlogged, i.e. it cannot proceed until its
+// egress drains. Then its descriptor is not watched, and the handler is called
+// again after config::egress_retry_interval until it returns false.
+struct reactor : detail::safe_desc
+{
+    using handler = std::function<bool (std::size_t budget)>;
+
+    // Time spent waiting for events, by mode.
+    struct counters
+    {
+        std::chrono::nanoseconds spin;    // polled without events
+        std::chrono::nanoseconds sleep;   // blocked in epoll_wait
+        std::uint64_t            wakeups; // returns from blocking wait
+    };
+
+    reactor();
+
+    void
+    add(int fd, handler h);
+
+    // Serve registered descriptors forever. If `spin` is non-zero, events are
+    // polled without blocking while traffic is present, and the loop falls
+    // back to blocking wait after idle for `spin`.
+    void
+    run(std::size_t budget, std::chrono::microseconds spin = std::chrono::microseconds::zero());
+
+    const counters &
+    stats() const noexcept { return stat; }
+
+private:
+    void
+    watch(std::size_t i, bool on);
+
+    std::vector<int>     fds;
+    std::vector<handler> handlers;
+    std::vector<bool>    backlog;
+    counters             stat;
+};
+
+} // namespace shinano
+
+#endif
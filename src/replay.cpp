@@ -0,0 +1,54 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <cstring>
+#include "replay.hpp"
+
+#include <boost/assert.hpp>
+
+namespace shinano {
+
+replay_ingress::replay_ingress(std::vector<std::vector<std::uint8_t>> packets, std::size_t count)
+  : packets(std::move(packets)), count(count), read(0)
+{
+    BOOST_ASSERT(!this->packets.empty());
+}
+
+boost::optional<std::size_t>
+replay_ingress::try_read(void *buf, std::size_t len)
+{
+    if (exhausted()) { return boost::none; }
+
+    const auto &p = packets[read++ % packets.size()];
+    const auto n = std::min(len, p.size());
+    std::memcpy(buf, p.data(), n);
+    return n;
+}
+
+
+void
+collect_egress::forward(const iovec *iov, int iovcnt, const sockaddr *, socklen_t,
+                        const virtio_net_hdr *, std::size_t)
+{
+    std::size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) { len += iov[i].iov_len; }
+
+    ++packets;
+    bytes += len;
+
+    if (outputs.size() < keep)
+    {
+        outputs.emplace_back();
+        auto &o = outputs.back();
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            auto p = static_cast<const std::uint8_t *>(iov[i].iov_base);
+            o.insert(o.end(), p, p + iov[i].iov_len);
+        }
+    }
+}
+
+} // namespace shinano
@@ -0,0 +1,71 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_replay_hpp_
+#define shinano_replay_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <boost/optional.hpp>
+
+#include "egress.hpp"
+
+namespace shinano {
+
+// In-memory ingress, which feeds prepared packets instead of TUN. Packets
+// should be led by packet information header as read from TUN, and are
+// replayed in order until `count` packets are read.
+struct replay_ingress
+{
+    replay_ingress(std::vector<std::vector<std::uint8_t>> packets, std::size_t count);
+
+    // Returns none if all packets are read.
+    boost::optional<std::size_t>
+    try_read(void *buf, std::size_t len);
+
+    bool
+    has_vnet_hdr() const noexcept { return false; }
+
+    bool
+    exhausted() const noexcept { return read == count; }
+
+private:
+    std::vector<std::vector<std::uint8_t>> packets;
+    std::size_t count;
+    std::size_t read;
+};
+
+// In-memory egress, which counts translated packets, and keeps first `keep`
+// of them for inspection.
+struct collect_egress : egress
+{
+    explicit
+    collect_egress(std::size_t keep = 0) noexcept
+      : keep(keep), packets(0), bytes(0) { }
+
+    virtual void
+    forward(const iovec *iov, int iovcnt, const sockaddr *addr, socklen_t addrlen,
+            const virtio_net_hdr *vnet, std::size_t headroom) override;
+
+    std::size_t
+    count() const noexcept { return packets; }
+
+    std::size_t
+    size() const noexcept { return bytes; }
+
+    const std::vector<std::vector<std::uint8_t>> &
+    kept() const noexcept { return outputs; }
+
+private:
+    std::size_t keep;
+    std::size_t packets;
+    std::size_t bytes;
+    std::vector<std::vector<std::uint8_t>> outputs;
+};
+
+} // namespace shinano
+
+#endif
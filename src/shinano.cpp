@@ -4,63 +4,897 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <cerrno>
 #include <boost/exception/diagnostic_information.hpp>
 #include "detail/exception.hpp"
 
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+
 #include "detail/dump.hpp"
 
 #include "config.hpp"
+#include "util.hpp"
 #include "socket.hpp"
+#include "egress.hpp"
+#include "uring.hpp"
+#include "reactor.hpp"
+#include "replay.hpp"
+#include "packet_pool.hpp"
 #include "translate.hpp"
+#include "translate/address_table.hpp"
+#include "translate/pref64.hpp"
+#include "translate/v4pool.hpp"
 using namespace shinano;
 
+// Translate a packet read from TUN, which is led by packet information header,
+// and virtio_net_hdr if `vnet`.
 void
-do_work(tuntap is, raw os4, raw os6)
+dispatch(egress &os4, egress &os6, buffer_ref bref, bool vnet)
 {
-    input_buffer buffer;
+    // Packet larger than the buffer is truncated by the TUN.
+    if (bref.data_as<tun_pi>()->flags & TUN_PKT_STRIP)
+    {
+        std::cout << "warning: dropped: packet exceeds input buffer" << std::endl;
+        return;
+    }
+
+    const auto proto = *bref.data_as<ieee::protocol_number>(2);
+    auto pkt = bref.next_to(sizeof(tun_pi));
+
+    // Copy out virtio_net_hdr, since translated header may be placed over it.
+    virtio_net_hdr offload;
+    if (vnet)
+    {
+        offload = *pkt.data_as<virtio_net_hdr>();
+        pkt = pkt.next_to(sizeof(virtio_net_hdr));
+    }
+
+    switch (proto)
+    {
+      case ieee::protocol_number::ip:
+        // v4 to v6
+        if (translate<ipv6>(os6, pkt, vnet ? &offload : nullptr)) { return; }
+        break;
+
+      case ieee::protocol_number::ipv6:
+        // v6 to v4
+        if (translate<ipv4>(os4, pkt, vnet ? &offload : nullptr)) { return; }
+        break;
+    }
+    std::cout
+      << "warning: unknown internet layer protocol"
+      << " (in " << bref.size() << " bytes)"
+      << std::endl;
+    debug::dump(std::cout, bref);
+}
+
+// Read and translate at most `budget` packets from the ingress, and flush the
+// egress. Ingress is any type which has try_read(void *, std::size_t), which
+// returns boost::optional<std::size_t>, and has_vnet_hdr(). Each packet is
+// read into its own buffer from the pool, which is held in `held` until flush,
+// since queued packets may refer them.
+//
+// If the egress is backlogged, nothing is read until it drains, so that the
+// kernel holds packets on the ingress instead of dropping them here.
+template <typename Ingress>
+std::size_t
+drain(Ingress &is, egress &os4, egress &os6, packet_pool::cache &buffers, std::vector<packet> &held,
+      std::size_t budget)
+{
+    BOOST_ASSERT(held.empty());
+
+    table_tick();
+    if (os4.backlogged() || os6.backlogged())
+    {
+        os4.flush();
+        os6.flush();
+        if (os4.backlogged() || os6.backlogged()) { return 0; }
+    }
+
+    std::size_t i = 0;
+    for (; i < budget; ++i)
+    {
+        constexpr auto headroom = config::input_headroom;
+        auto buffer = buffers.acquire();
+        if (!buffer) { break; }
+
+        const auto len = is.try_read(buffer.data() + headroom, buffer.size() - headroom);
+        if (!len)
+        {
+            buffers.release(std::move(buffer));
+            break;
+        }
+
+        dispatch(os4, os6, make_buffer_ref(buffer, *len, headroom), is.has_vnet_hdr());
+        held.push_back(std::move(buffer));
+    }
+    os4.flush();
+    os6.flush();
+
+    // Queued packets are either sent or copied out by flush.
+    for (auto &b : held) { buffers.release(std::move(b)); }
+    held.clear();
+    return i;
+}
+
+// Serve the queue on the reactor. Translated packets may be queued on egress,
+// and flushed when ingress would block or the budget is exhausted.
+void
+serve(reactor &r, tuntap &is, egress &os4, egress &os6, packet_pool::cache &buffers,
+      std::vector<packet> &held)
+{
+    is.nonblocking();
+
+    r.add(is.native(), [&is, &os4, &os6, &buffers, &held](std::size_t budget)
+    {
+        drain(is, os4, os6, buffers, held, budget);
+        return os4.backlogged() || os6.backlogged();
+    });
+}
+
+// Completion-driven datapath on io_uring. Each slot has a registered input
+// buffer with pending READ_FIXED on the TUN. Translated packet is sent by an
+// operation linked before the next read into same slot, so that the slot is
+// reused only after the send completes.
+void
+do_work(tuntap &is, uring_egress &os, packet_pool &pool, int os4, int os6)
+{
+    constexpr std::size_t depth = config::uring_depth;
+    enum : int { tun_index, os4_index, os6_index };
+
+    uring ring(2 * depth);
+    const int fds[] = {is.native(), os4, os6};
+    ring.register_files(fds, os.writes_tuntap() ? 1 : 3);
+
+    // Buffers are held for the lifetime of the ring, since they are registered.
+    packet_pool::cache cache(pool);
+    std::vector<packet> buffers;
+    buffers.reserve(depth);
+    for (std::size_t i = 0; i < depth; ++i)
+    {
+        buffers.push_back(cache.acquire());
+        BOOST_ASSERT(buffers.back());
+    }
+
+    std::vector<iovec> regs(2 * depth);
+    for (std::size_t i = 0; i < depth; ++i)
+    {
+        regs[i].iov_base         = buffers[i].data();
+        regs[i].iov_len          = buffers[i].size();
+        regs[depth + i].iov_base = os[i].bytes.data();
+        regs[depth + i].iov_len  = os[i].bytes.size();
+    }
+    ring.register_buffers(regs.data(), regs.size());
+
+    // Each slot has at most two SQEs in flight, so that SQ never overflows.
+    auto post_read = [&](std::size_t i)
+    {
+        auto sqe = ring.get_sqe();
+        BOOST_ASSERT(sqe);
+        sqe->opcode    = IORING_OP_READ_FIXED;
+        sqe->flags     = IOSQE_FIXED_FILE;
+        sqe->fd        = tun_index;
+        sqe->addr      = reinterpret_cast<std::uintptr_t>(buffers[i].data() + config::input_headroom);
+        sqe->len       = buffers[i].size() - config::input_headroom;
+        sqe->buf_index = i;
+        sqe->user_data = (i << 1) | 1;
+    };
+    auto post_send = [&](std::size_t i)
+    {
+        auto &s = os[i];
+        auto sqe = ring.get_sqe();
+        BOOST_ASSERT(sqe);
+        if (os.writes_tuntap())
+        {
+            sqe->opcode    = IORING_OP_WRITE_FIXED;
+            sqe->fd        = tun_index;
+            sqe->addr      = reinterpret_cast<std::uintptr_t>(s.data);
+            sqe->len       = s.len;
+            sqe->buf_index = s.inplace ? i : depth + i;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd     = s.name.ss_family == AF_INET6 ? os6_index : os4_index;
+            sqe->addr   = reinterpret_cast<std::uintptr_t>(&s.msg);
+            sqe->len    = 1;
+        }
+        sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->user_data = i << 1;
+    };
+
+    for (std::size_t i = 0; i < depth; ++i) { post_read(i); }
 
     while (true)
     {
-        auto bref = [&]() -> buffer_ref
+        ring.submit(1);
+        table_tick();
+
+        for (io_uring_cqe *cqe; (cqe = ring.peek_cqe()); ring.cqe_seen())
         {
-            const auto len = is.read(buffer);
-            if (len < 0) { throw_with_errno(); }
-            return make_buffer_ref(buffer, len);
-        }();
+            const std::size_t i = cqe->user_data >> 1;
+            const bool is_read  = cqe->user_data & 1;
+            const int res       = cqe->res;
+
+            if (!is_read)
+            {
+                if (res < 0)
+                {
+                    std::cerr << "warning: egress failed: " << std::strerror(-res) << std::endl;
+                }
+                continue;
+            }
+
+            if (res < 0)
+            {
+                // Cancelled if linked send is failed.
+                if (res != -ECANCELED && res != -EINTR && res != -EAGAIN)
+                {
+                    errno = -res;
+                    throw_with_errno();
+                }
+                post_read(i);
+                continue;
+            }
+
+            os.select(i);
+            dispatch(os, os, make_buffer_ref(buffers[i], res, config::input_headroom), is.has_vnet_hdr());
+            if (os[i].len) { post_send(i); }
+            post_read(i);
+        }
+    }
+}
+
+void
+do_work(xsk &is, xsk_egress &os)
+{
+    while (true)
+    {
+        table_tick();
 
-        switch (*bref.data_as<ieee::protocol_number>(2))
+        xsk::frame f;
+        if (!is.receive(f))
+        {
+            os.flush();
+            is.poll(POLLIN);
+            continue;
+        }
+        buffer_ref bref = {static_cast<std::uint8_t *>(f.data), f.len, 0};
+
+        if (bref.size() < sizeof(ether_header))
+        {
+            is.release(f);
+            continue;
+        }
+        auto &eth = *bref.data_as<ether_header>();
+        os.reply_to(eth);
+
+        // Short frames are padded up to the Ethernet minimum, then the
+        // datagram is cut out by its own length.
+        const auto proto = static_cast<ieee::protocol_number>(eth.ether_type);
+        auto pkt = bref.next_to(sizeof(ether_header));
+        auto datagram = pkt.size();
+        switch (proto)
         {
           case ieee::protocol_number::ip:
-            // v4 to v6
-            if (translate<ipv6>(os6, bref.next_to(4))) { continue; }
+            datagram = pkt.size() < sizeof(ip) ? 0 : net_to_host(pkt.data_as<ip>()->ip_len);
+            if (datagram < sizeof(ip)) { datagram = 0; }
             break;
 
           case ieee::protocol_number::ipv6:
-            // v6 to v4
-            if (translate<ipv4>(os4, bref.next_to(4))) { continue; }
+            datagram = pkt.size() < sizeof(ip6_hdr)
+                     ? 0 : sizeof(ip6_hdr) + net_to_host(pkt.data_as<ip6_hdr>()->ip6_plen);
             break;
         }
+        if (datagram == 0 || pkt.size() < datagram)
+        {
+            std::cout << "warning: dropped: frame shorter than its datagram (in " << bref.size() << " bytes)" << std::endl;
+            is.release(f);
+            continue;
+        }
+        pkt.resize(datagram);
+
+        const bool translated = [&]
+        {
+            switch (proto)
+            {
+              case ieee::protocol_number::ip:
+                // v4 to v6
+                return translate<ipv6>(os, pkt);
+
+              case ieee::protocol_number::ipv6:
+                // v6 to v4
+                return translate<ipv4>(os, pkt);
+            }
+            return false;
+        }();
+        if (!translated)
+        {
+            std::cout
+              << "warning: unknown internet layer protocol"
+              << " (in " << bref.size() << " bytes)"
+              << std::endl;
+            debug::dump(std::cout, bref);
+        }
+
+        is.release(f);
+    }
+}
+
+enum class egress_mode
+{
+    raw,
+    tuntap,
+};
+
+enum class engine_mode
+{
+    loop,
+    uring,
+};
+
+// Each worker owns one queue of every interface, cache of input buffers and
+// raw sockets, so that workers never share any descriptor.
+void
+run_worker(std::vector<tuntap> queues, packet_pool &pool, egress_mode mode, engine_mode engine,
+           std::chrono::microseconds busy_poll) try
+{
+    if (engine == engine_mode::uring)
+    {
+        BOOST_ASSERT(queues.size() == 1);
+        auto &is = queues.front();
+
+        uring_egress os(config::uring_depth, mode == egress_mode::tuntap, is.has_vnet_hdr());
+        if (mode == egress_mode::tuntap)
+        {
+            do_work(is, os, pool, -1, -1);
+            return;
+        }
+
+        auto os4 = make_raw<raw::ipv4_tag>();
+        auto os6 = make_raw<raw::ipv6_tag>();
+        do_work(is, os, pool, os4.native(), os6.native());
+        return;
+    }
+
+    packet_pool::cache buffers(pool);
+    std::vector<packet> held;
+    held.reserve(config::reactor_budget);
+    reactor r;
+
+    if (mode == egress_mode::tuntap)
+    {
+        std::vector<tuntap_egress> os;
+        os.reserve(queues.size());
+        for (auto &q : queues)
+        {
+            os.emplace_back(q);
+            serve(r, q, os.back(), os.back(), buffers, held);
+        }
+        r.run(config::reactor_budget, busy_poll);
+        return;
+    }
+
+    auto os4 = make_raw<raw::ipv4_tag>();
+    auto os6 = make_raw<raw::ipv6_tag>();
+    raw_egress e4(os4), e6(os6);
+
+    for (auto &q : queues) { serve(r, q, e4, e6, buffers, held); }
+    r.run(config::reactor_budget, busy_poll);
+}
+catch (boost::exception &e)
+{
+    std::cout << boost::diagnostic_information(e) << std::endl;
+}
+
+void
+run_xdp_worker(xdp_program &prog, std::uint32_t queue) try
+{
+    xsk is(prog, queue);
+    xsk_egress os(is);
+
+    do_work(is, os);
+}
+catch (boost::exception &e)
+{
+    std::cout << boost::diagnostic_information(e) << std::endl;
+}
+
+// UDP packet led by packet information header, as read from TUN.
+std::vector<std::uint8_t>
+make_udp_packet(const in6_addr &src, const in6_addr &dst, std::size_t payload)
+{
+    std::vector<std::uint8_t> p(sizeof(tun_pi) + sizeof(ip6_hdr) + sizeof(udphdr) + payload);
+
+    const auto pi = designated((tun_pi)) by
+    (
+      ((.proto = static_cast<std::uint16_t>(ieee::protocol_number::ipv6)))
+    );
+    const auto ip6 = designated((ip6_hdr)) by
+    (
+      ((.ip6_vfc  = (6 << 4)))
+      ((.ip6_plen = host_to_net<std::uint16_t>(sizeof(udphdr) + payload)))
+      ((.ip6_nxt  = IPPROTO_UDP))
+      ((.ip6_hlim = 64))
+      ((.ip6_src  = src))
+      ((.ip6_dst  = dst))
+    );
+    const auto udp = designated((udphdr)) by
+    (
+      ((.source = host_to_net<std::uint16_t>(5555)))
+      ((.dest   = host_to_net<std::uint16_t>(9999)))
+      ((.len    = host_to_net<std::uint16_t>(sizeof(udphdr) + payload)))
+    );
+
+    std::memcpy(&p[0], &pi, sizeof(pi));
+    std::memcpy(&p[sizeof(pi)], &ip6, sizeof(ip6));
+    std::memcpy(&p[sizeof(pi) + sizeof(ip6)], &udp, sizeof(udp));
+    return p;
+}
+
+std::vector<std::uint8_t>
+make_udp_packet(const in_addr &src, const in_addr &dst, std::size_t payload,
+                std::uint16_t port = host_to_net<std::uint16_t>(5555))
+{
+    std::vector<std::uint8_t> p(sizeof(tun_pi) + sizeof(ip) + sizeof(udphdr) + payload);
+
+    const auto pi = designated((tun_pi)) by
+    (
+      ((.proto = static_cast<std::uint16_t>(ieee::protocol_number::ip)))
+    );
+    const auto ip4 = designated((ip)) by
+    (
+      ((.ip_v   = 4))
+      ((.ip_hl  = sizeof(ip) / 4))
+      ((.ip_len = host_to_net<std::uint16_t>(sizeof(ip) + sizeof(udphdr) + payload)))
+      ((.ip_ttl = 64))
+      ((.ip_p   = IPPROTO_UDP))
+      ((.ip_src = src))
+      ((.ip_dst = dst))
+    );
+    const auto udp = designated((udphdr)) by
+    (
+      ((.source = host_to_net<std::uint16_t>(9999)))
+      ((.dest   = port))
+      ((.len    = host_to_net<std::uint16_t>(sizeof(udphdr) + payload)))
+    );
+
+    std::memcpy(&p[0], &pi, sizeof(pi));
+    std::memcpy(&p[sizeof(pi)], &ip4, sizeof(ip4));
+    std::memcpy(&p[sizeof(pi) + sizeof(ip4)], &udp, sizeof(udp));
+    return p;
+}
+
+// Measure translation alone on in-memory backend, which requires neither root
+// nor TUN. Flows of v6 to v4 and their replies are replayed alternately.
+void
+run_benchmark(std::size_t count)
+{
+    constexpr std::size_t flows   = 64;
+    constexpr std::size_t payload = 512;
+
+    in6_addr client;
+    in_addr  server;
+    ::inet_pton(AF_INET6, "2001:db8::", &client);
+    ::inet_pton(AF_INET, "198.18.0.1", &server);
+    const auto server6 = make_embedded_address(server, pref64_at(0).prefix, pref64_at(0).plen);
+
+    std::vector<std::vector<std::uint8_t>> packets;
+    for (std::size_t i = 0; i < flows; ++i)
+    {
+        auto src = client;
+        src.s6_addr[15] = i + 1;
+        packets.push_back(make_udp_packet(src, server6, payload));
+        // Bind the flow, so that its reply is translated.
+        if (napt_enabled())
+        {
+            const auto ep = lookup(endpoint6{src, host_to_net<std::uint16_t>(5555)},
+                                   iana::protocol_number::udp, 0);
+            packets.push_back(make_udp_packet(server, ep.addr, payload, ep.port));
+        }
+        else
+        {
+            packets.push_back(make_udp_packet(server, lookup(src), payload));
+        }
+    }
+
+    // Printing each packet would dominate the measurement.
+    temporary_show_detail(false);
+
+    replay_ingress is(std::move(packets), count);
+    collect_egress os;
+    packet_pool pool(input_buffer_size(ETH_DATA_LEN), config::packet_pool_slots);
+    packet_pool::cache buffers(pool);
+    std::vector<packet> held;
+    held.reserve(config::reactor_budget);
+
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+    while (!is.exhausted()) { drain(is, os, os, buffers, held, config::reactor_budget); }
+    const std::chrono::duration<double> elapsed = clock::now() - start;
+
+    std::cerr
+      << "benchmark: " << count << " packets in " << elapsed.count() << " s"
+      << ", " << count / elapsed.count() / 1e6 << " Mpps"
+      << ", " << os.count() << " translated (" << os.size() << " bytes)"
+      << std::endl;
+}
+
+void
+pin_to_cpu(std::thread &th, std::size_t n) noexcept
+{
+    const auto ncpu = std::thread::hardware_concurrency();
+    if (ncpu == 0) { return; }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(n % ncpu, &set);
+    // Not fatal; the scheduler can still place the worker.
+    ::pthread_setaffinity_np(th.native_handle(), sizeof(set), &set);
+}
+
+// Print addresses bound in each stateless pool; nothing with NAPT.
+void
+report_pools()
+{
+    const auto bound = table_occupancy();
+    for (std::uint32_t i = 0; i < bound.size(); ++i)
+    {
+        const auto &p = v4pool_at(i);
         std::cout
-          << "warning: unknown internet layer protocol"
-          << " (in " << bref.size() << " bytes)"
+          << "info: v4 pool " << to_string(p.prefix) << "/" << p.plen << ": "
+          << bound[i] << " of " << (std::uint32_t(1) << (32 - p.plen)) - 2 << " addresses bound"
           << std::endl;
-        debug::dump(std::cout, bref);
     }
 }
 
+// Save the NAT table into `path` whenever SIGUSR1 arrives if `path` is given,
+// and report occupancy of v4 pools on SIGUSR2. Both should be blocked in every
+// thread.
+void
+handle_signals(const char *path) noexcept
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    if (path) { sigaddset(&set, SIGUSR1); }
+    for (int sig; ; )
+    {
+        if (::sigwait(&set, &sig) != 0) { continue; }
+        if (sig == SIGUSR2)
+        {
+            report_pools();
+            continue;
+        }
+
+        try
+        {
+            const auto n = table_save(path);
+            std::cout << "info: NAT table: saved " << n << " entries into " << path << std::endl;
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << "warning: NAT table: failed to save into " << path << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+// Parse `<address>/<length>`.
+bool
+parse_prefix(const std::string &s, in_addr &address, std::size_t &len)
+{
+    const auto slash = s.find('/');
+    if (slash == std::string::npos
+     || ::inet_pton(AF_INET, s.substr(0, slash).c_str(), &address) != 1)
+    {
+        return false;
+    }
+    len = std::stoul(s.substr(slash + 1));
+    return 0 < len && len <= 32;
+}
+
+// Parse `<address>/<length>` of IPv6, whose length is checked by users.
+bool
+parse_prefix(const std::string &s, in6_addr &address, std::size_t &len)
+{
+    const auto slash = s.find('/');
+    if (slash == std::string::npos
+     || ::inet_pton(AF_INET6, s.substr(0, slash).c_str(), &address) != 1)
+    {
+        return false;
+    }
+    len = std::stoul(s.substr(slash + 1));
+    return true;
+}
+
+// Parse `<address>/<length>[*<weight>][@<customer>]`.
+bool
+parse_pool(const std::string &s, v4pool &p)
+{
+    const auto at = s.find('@');
+    auto prefix = s.substr(0, at);
+    const auto star = prefix.find('*');
+    p.weight = 1;
+    if (star != std::string::npos)
+    {
+        p.weight = std::stoul(prefix.substr(star + 1));
+        prefix.resize(star);
+    }
+    if (!parse_prefix(prefix, p.prefix, p.plen)) { return false; }
+
+    p.customer = in6addr_any;
+    p.customer_plen = 0;
+    return at == std::string::npos
+        || (parse_prefix(s.substr(at + 1), p.customer, p.customer_plen) && p.customer_plen != 0);
+}
+
+void
+usage(const char *argv0)
+{
+    std::cerr
+      << "usage: " << argv0 << " [-q <queues>] [-6 <pref64>]... [-4 <pool>]... [-s <pool>] [-p <name>] [-w <file>] [-r <file>] [-t [-g] [-n]] [-b <usecs>] <tun-if-name>..." << std::endl
+      << "       " << argv0 << " [-q <queues>] [-6 <pref64>]... [-4 <pool>]... [-s <pool>] [-p <name>] [-w <file>] [-r <file>] [-t [-g] [-n]] -u <tun-if-name>" << std::endl
+      << "       " << argv0 << " [-q <queues>] [-6 <pref64>]... [-4 <pool>]... [-s <pool>] [-p <name>] [-w <file>] [-r <file>] -x <if-name>" << std::endl
+      << "       " << argv0 << " [-6 <pref64>]... [-4 <pool>]... [-s <pool>] -m <packets>" << std::endl
+      << "    -q <queues>  number of TUN queues and translation workers;" << std::endl
+      << "                 0 means one per CPU (default: 1)" << std::endl
+      << "    -6 <pref64>  translate v6 packets toward <pref64>, e.g. 2001:db8:64::/96;" << std::endl
+      << "                 given several times, the longest match is taken, and" << std::endl
+      << "                 replies take the prefix which the host used" << std::endl
+      << "                 (default: 64:ff9b::/96)" << std::endl
+      << "    -4 <pool>    bind addresses of <pool>, e.g. 198.51.100.0/24, to v6 hosts" << std::endl
+      << "                 instead of 100.64.0.0/10; given several times, a host takes" << std::endl
+      << "                 a pool by weight <w> of <pool>*<w> (default: 1), or pools of" << std::endl
+      << "                 <pool>@<prefix> alone if it's in v6 <prefix>; occupancy of" << std::endl
+      << "                 pools is reported on SIGUSR2" << std::endl
+      << "    -s <pool>    stateful NAPT (RFC 6146); v6 hosts share addresses of" << std::endl
+      << "                 <pool>, e.g. 192.0.2.0/24, by TCP/UDP port and ICMP identifier" << std::endl
+      << "    -p <name>    keep NAT table on shared memory <name>, and take over the" << std::endl
+      << "                 table left there, so that bindings survive restart" << std::endl
+      << "    -w <file>    save snapshot of NAT table into <file> on SIGUSR1" << std::endl
+      << "    -r <file>    restore NAT table from snapshot <file> at startup, instead" << std::endl
+      << "                 of taking over the table of -p" << std::endl
+      << "    -t           write translated packets back into the TUN device" << std::endl
+      << "                 instead of raw sockets" << std::endl
+      << "    -g           exchange GSO and checksum offloaded packets with the TUN" << std::endl
+      << "                 device through virtio_net_hdr (requires -t)" << std::endl
+      << "    -n           inject translated packets through NAPI, so that the kernel" << std::endl
+      << "                 runs GRO over them (requires -t)" << std::endl
+      << "    -b <usecs>   spin on nonblocking polls while traffic is present, and" << std::endl
+      << "                 block after idle for <usecs>; time spent spinning and" << std::endl
+      << "                 sleeping is reported periodically" << std::endl
+      << "    -u           drive I/O by io_uring instead of epoll reactor" << std::endl
+      << "    -x           attach AF_XDP sockets to the interface in generic mode" << std::endl
+      << "                 instead of TUN device" << std::endl
+      << "    -m <packets> translate <packets> on in-memory backend, and report" << std::endl
+      << "                 throughput of translation alone" << std::endl;
+}
+
 int main(int argc, char **argv) try
 {
-    temporary_table_init();
+    std::size_t nqueues = 1;
+    auto mode = egress_mode::raw;
+    auto engine = engine_mode::loop;
+    bool xdp = false;
+    bool gso = false;
+    bool napi = false;
+    std::chrono::microseconds busy_poll {0};
+    std::size_t bench = 0;
+    bool napt = false;
+    in_addr napt_pool;
+    std::size_t napt_plen = 0;
+    const char *segment = nullptr;
+    const char *save = nullptr;
+    const char *load = nullptr;
+    std::vector<pref64> prefixes;
+    std::vector<v4pool> pools;
 
-    auto is = make_tuntap<tuntap::tun_tag>(argv[1]);
-    is.up();
+    for (int opt; (opt = ::getopt(argc, argv, "q:6:4:s:p:w:r:tgnb:uxm:")) != -1; )
+    {
+        switch (opt)
+        {
+          case 'q':
+            nqueues = std::stoul(optarg);
+            break;
 
-    auto os4 = make_raw<raw::ipv4_tag>();
-    auto os6 = make_raw<raw::ipv6_tag>();
+          case '6':
+            prefixes.emplace_back();
+            if (!parse_prefix(optarg, prefixes.back().prefix, prefixes.back().plen))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+          case '4':
+            pools.emplace_back();
+            if (!parse_pool(optarg, pools.back()))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
 
-    do_work(std::move(is), std::move(os4), std::move(os6));
+          case 's':
+            if (!parse_prefix(optarg, napt_pool, napt_plen))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            napt = true;
+            break;
+
+          case 'p':
+            segment = optarg;
+            break;
+
+          case 'w':
+            save = optarg;
+            break;
+
+          case 'r':
+            load = optarg;
+            break;
+
+          case 't':
+            mode = egress_mode::tuntap;
+            break;
+
+          case 'g':
+            gso = true;
+            break;
+
+          case 'n':
+            napi = true;
+            break;
+
+          case 'b':
+            busy_poll = std::chrono::microseconds(std::stoul(optarg));
+            break;
+
+          case 'u':
+            engine = engine_mode::uring;
+            break;
+
+          case 'x':
+            xdp = true;
+            break;
+
+          case 'm':
+            bench = std::stoul(optarg);
+            break;
+
+          default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // Stateless pools are meaningless with NAPT.
+    if (napt && !pools.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    pref64_init(std::move(prefixes));
+    v4pool_init(std::move(pools));
+    if (bench)
+    {
+        if (napt) { napt_init(napt_pool, napt_plen); }
+        temporary_table_init();
+        run_benchmark(bench);
+        return 0;
+    }
+
+    // Raw sockets cannot carry offloaded packets.
+    const bool single = (xdp || engine == engine_mode::uring);
+    if (optind == argc || (single && optind != argc - 1)
+     || ((gso || napi) && (xdp || mode != egress_mode::tuntap))
+     || (busy_poll.count() && single))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nqueues == 0)
+    {
+        nqueues = std::max(1u, std::thread::hardware_concurrency());
+    }
+    nqueues = std::min(nqueues, config::max_tuntap_queues);
+
+    if (napt) { napt_init(napt_pool, napt_plen); }
+    if (temporary_table_init(segment, load != nullptr))
+    {
+        std::cout << "info: NAT table: taken over from " << segment << std::endl;
+    }
+    if (load)
+    {
+        const auto stats = table_restore(load);
+        std::cout
+          << "info: NAT table: restored " << stats.restored << " entries from " << load
+          << " (" << stats.skipped << " skipped)"
+          << std::endl;
+    }
+    {
+        // Every thread inherits the mask, and only the handler takes signals.
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR2);
+        if (save) { sigaddset(&set, SIGUSR1); }
+        ::pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        std::thread(handle_signals, save).detach();
+    }
+
+    if (xdp)
+    {
+        xdp_program prog(argv[optind], nqueues, pref64_all());
+
+        std::vector<std::thread> workers;
+        for (std::uint32_t q = 0; q < nqueues; ++q)
+        {
+            workers.emplace_back(run_xdp_worker, std::ref(prog), q);
+            if (nqueues > 1) { pin_to_cpu(workers.back(), q); }
+        }
+
+        for (auto &th : workers) { th.join(); }
+        return 0;
+    }
+
+    // queues[q] has q-th queue of every interface.
+    std::vector<std::vector<tuntap>> queues(nqueues);
+    for (int i = optind; i < argc; ++i)
+    {
+        auto qs = make_tuntap_queues<tuntap::tun_tag>(argv[i], nqueues,
+                                                      (gso  ? tuntap::vnet_hdr : 0)
+                                                    | (napi ? tuntap::napi     : 0));
+        if (gso)
+        {
+            for (auto &q : qs) { q.offload(TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN); }
+        }
+        qs.front().up();
+
+        for (std::size_t q = 0; q < nqueues; ++q) { queues[q].push_back(std::move(qs[q])); }
+    }
+
+    // Buffers fit the largest MTU among interfaces at startup, or GSO packets.
+    std::size_t mtu = IP_MAXPACKET;
+    if (!gso)
+    {
+        mtu = 0;
+        for (const auto &q : queues.front()) { mtu = std::max(mtu, q.mtu()); }
+    }
+    packet_pool pool(input_buffer_size(mtu), nqueues * config::packet_pool_slots);
+    std::cout
+      << "info: packet pool: " << pool.capacity() << " buffers of " << pool.slot_size() << " bytes"
+      << (pool.hugepage() ? " on hugepages" : "")
+      << std::endl;
+
+    std::vector<std::thread> workers;
+    workers.reserve(queues.size());
+    for (auto &q : queues)
+    {
+        workers.emplace_back(run_worker, std::move(q), std::ref(pool), mode, engine, busy_poll);
+        if (nqueues > 1) { pin_to_cpu(workers.back(), workers.size() - 1); }
+    }
+
+    for (auto &th : workers) { th.join(); }
 }
 catch (boost::exception &e)
 {
     std::cout << boost::diagnostic_information(e) << std::endl;
 }
+catch (std::exception &e)
+{
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return 1;
+}
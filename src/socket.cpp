@@ -3,13 +3,24 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <algorithm>
 #include <string>
 #include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <vector>
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
-#include <linux/if.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/ethernet.h>
 #include <linux/if_tun.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
 #include "socket.hpp"
 
 #include "detail/designated_initializer.hpp"
@@ -23,7 +34,7 @@ controle_socket::controle_socket()
 
 
 tuntap::tuntap(int flags, std::string name)
-  : safe_desc(::open("/dev/net/tun", O_RDWR))
+  : safe_desc(::open("/dev/net/tun", O_RDWR)), flags(flags)
 {
     auto ifr = designated((ifreq)) by
     (
@@ -37,10 +48,10 @@ tuntap::tuntap(int flags, std::string name)
     index = ifr.ifr_ifindex;
 }
 
-tuntap::tuntap(tap_tag, std::string name)
-  : tuntap(IFF_TAP, name) { }
-tuntap::tuntap(tun_tag, std::string name)
-  : tuntap(IFF_TUN, name) { }
+tuntap::tuntap(tap_tag, std::string name, int features)
+  : tuntap(IFF_TAP | features, name) { }
+tuntap::tuntap(tun_tag, std::string name, int features)
+  : tuntap(IFF_TUN | features, name) { }
 
 void
 tuntap::up(bool up)
@@ -58,6 +69,27 @@ tuntap::up(bool up)
     cs.ioctl(SIOCSIFFLAGS, &ifr);
 }
 
+std::size_t
+tuntap::mtu() const
+{
+    controle_socket cs;
+    auto ifr = designated((ifreq)) by
+    (
+      ((.ifr_ifindex = index))
+    );
+    cs.ioctl(SIOCGIFNAME, &ifr);
+
+    cs.ioctl(SIOCGIFMTU, &ifr);
+    return ifr.ifr_mtu;
+}
+
+void
+tuntap::offload(unsigned offloads)
+{
+    BOOST_ASSERT(has_vnet_hdr());
+    ioctl(TUNSETOFFLOAD, static_cast<unsigned long>(offloads));
+}
+
 
 raw::raw(int family)
   : safe_desc(::socket(family, SOCK_RAW, IPPROTO_RAW))
@@ -74,4 +106,346 @@ raw::raw(raw::ipv6_tag)
 {
 }
 
+
+
+namespace {
+
+int
+bpf(int cmd, bpf_attr attr) noexcept
+{
+    return ::syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+bpf_insn
+insn(std::uint8_t code, std::uint8_t dst, std::uint8_t src, std::int16_t off, std::int32_t imm) noexcept
+{
+    bpf_insn i = {};
+    i.code    = code;
+    i.dst_reg = dst;
+    i.src_reg = src;
+    i.off     = off;
+    i.imm     = imm;
+    return i;
+}
+
+int
+interface_index(const std::string &name)
+{
+    const int index = ::if_nametoindex(name.c_str());
+    if (index == 0) { throw_with_errno(); }
+    return index;
+}
+
+int
+make_xskmap(std::size_t queues) noexcept
+{
+    return bpf(BPF_MAP_CREATE, designated((bpf_attr)) by
+    (
+      ((.map_type    = BPF_MAP_TYPE_XSKMAP))
+      ((.key_size    = sizeof(std::uint32_t)))
+      ((.value_size  = sizeof(std::uint32_t)))
+      ((.max_entries = static_cast<std::uint32_t>(queues)))
+    ));
+}
+
+// Equivalent to following pseudo code.
+//
+//     if (eth.type == ip) { return redirect_map(map, rx_queue_index, XDP_PASS); }
+//     if (eth.type == ipv6 && ip6.dst is under any of prefixes) { <<same as above>> }
+//     return XDP_PASS;
+int
+load_redirect(int map, const std::vector<pref64> &prefixes) noexcept
+{
+    enum : std::uint8_t { r0, r1, r2, r3, r4, r5, r6, r7 };
+
+    std::vector<bpf_insn> p;
+    std::vector<std::size_t> to_pass, to_redirect;
+    auto emit = [&](bpf_insn i) { p.push_back(i); return p.size() - 1; };
+
+    constexpr std::int32_t eth_len  = sizeof(ether_header);
+    constexpr std::int32_t ip6_dst  = eth_len + offsetof(ip6_hdr, ip6_dst);
+
+    emit(insn(BPF_ALU64 | BPF_MOV | BPF_X, r6, r1, 0, 0));
+    emit(insn(BPF_LDX | BPF_MEM | BPF_W, r2, r1, offsetof(xdp_md, data), 0));
+    emit(insn(BPF_LDX | BPF_MEM | BPF_W, r3, r1, offsetof(xdp_md, data_end), 0));
+
+    // ethernet header
+    emit(insn(BPF_ALU64 | BPF_MOV | BPF_X, r4, r2, 0, 0));
+    emit(insn(BPF_ALU64 | BPF_ADD | BPF_K, r4, 0, 0, eth_len));
+    to_pass.push_back(emit(insn(BPF_JMP | BPF_JGT | BPF_X, r4, r3, 0, 0)));
+    emit(insn(BPF_LDX | BPF_MEM | BPF_H, r5, r2, offsetof(ether_header, ether_type), 0));
+    to_redirect.push_back(emit(insn(BPF_JMP | BPF_JEQ | BPF_K, r5, 0, 0,
+                                    static_cast<std::uint16_t>(ieee::protocol_number::ip))));
+    to_pass.push_back(emit(insn(BPF_JMP | BPF_JNE | BPF_K, r5, 0, 0,
+                                static_cast<std::uint16_t>(ieee::protocol_number::ipv6))));
+
+    // ipv6 header
+    emit(insn(BPF_ALU64 | BPF_MOV | BPF_X, r4, r2, 0, 0));
+    emit(insn(BPF_ALU64 | BPF_ADD | BPF_K, r4, 0, 0, eth_len + sizeof(ip6_hdr)));
+    to_pass.push_back(emit(insn(BPF_JMP | BPF_JGT | BPF_X, r4, r3, 0, 0)));
+    // Prefixes are compared in turn by words, whose last one may be masked.
+    std::vector<std::size_t> to_next;
+    for (const auto &pref : prefixes)
+    {
+        for (auto j : to_next) { p[j].off = p.size() - j - 1; }
+        to_next.clear();
+
+        for (std::size_t i = 0; i * 32 < pref.plen; ++i)
+        {
+            emit(insn(BPF_LDX | BPF_MEM | BPF_W, r5, r2, ip6_dst + i * 4, 0));
+            if (pref.plen < (i + 1) * 32)
+            {
+                in6_addr mask = {};
+                std::fill_n(mask.s6_addr, pref.plen / 8, 0xff);
+                emit(insn(BPF_ALU | BPF_AND | BPF_K, r5, 0, 0, mask.s6_addr32[i]));
+            }
+            // 32bit move to avoid sign extension of immediate.
+            emit(insn(BPF_ALU | BPF_MOV | BPF_K, r7, 0, 0, pref.prefix.s6_addr32[i]));
+            to_next.push_back(emit(insn(BPF_JMP | BPF_JNE | BPF_X, r5, r7, 0, 0)));
+        }
+        to_redirect.push_back(emit(insn(BPF_JMP | BPF_JA, 0, 0, 0, 0)));
+    }
+    to_pass.insert(to_pass.end(), to_next.begin(), to_next.end());
+
+    const auto redirect = p.size();
+    emit(insn(BPF_LDX | BPF_MEM | BPF_W, r2, r6, offsetof(xdp_md, rx_queue_index), 0));
+    emit(insn(BPF_LD | BPF_DW | BPF_IMM, r1, BPF_PSEUDO_MAP_FD, 0, map));
+    emit(insn(0, 0, 0, 0, 0));
+    emit(insn(BPF_ALU64 | BPF_MOV | BPF_K, r3, 0, 0, XDP_PASS));
+    emit(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    emit(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    const auto pass = p.size();
+    emit(insn(BPF_ALU64 | BPF_MOV | BPF_K, r0, 0, 0, XDP_PASS));
+    emit(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    for (auto j : to_pass)     { p[j].off = pass - j - 1; }
+    for (auto j : to_redirect) { p[j].off = redirect - j - 1; }
+
+    static const char license[] = "BSD";
+    return bpf(BPF_PROG_LOAD, designated((bpf_attr)) by
+    (
+      ((.prog_type = BPF_PROG_TYPE_XDP))
+      ((.insn_cnt  = static_cast<std::uint32_t>(p.size())))
+      ((.insns     = reinterpret_cast<std::uintptr_t>(p.data())))
+      ((.license   = reinterpret_cast<std::uintptr_t>(license)))
+      ((.expected_attach_type = BPF_XDP))
+    ));
+}
+
+int
+attach_generic(int prog, int index) noexcept
+{
+    return bpf(BPF_LINK_CREATE, designated((bpf_attr)) by
+    (
+      ((.link_create.prog_fd        = static_cast<std::uint32_t>(prog)))
+      ((.link_create.target_ifindex = static_cast<std::uint32_t>(index)))
+      ((.link_create.attach_type    = BPF_XDP))
+      ((.link_create.flags          = XDP_FLAGS_SKB_MODE))
+    ));
+}
+
+template <typename T>
+detail::mapping
+map_ring(int fd, const xdp_ring_offset &off, off_t pgoff, detail::xdp_ring<T> &r)
+{
+    const std::size_t len = off.desc + config::xsk_ring_size * sizeof(T);
+    void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (p == MAP_FAILED) { throw_with_errno(); }
+
+    auto base  = static_cast<char *>(p);
+    r.producer = reinterpret_cast<std::uint32_t *>(base + off.producer);
+    r.consumer = reinterpret_cast<std::uint32_t *>(base + off.consumer);
+    r.ring     = reinterpret_cast<T *>(base + off.desc);
+    r.mask     = config::xsk_ring_size - 1;
+    r.cached   = 0;
+    return detail::mapping(p, detail::unmap_delete{len});
+}
+
+} // namespace shinano::<anonymous-namespace>
+
+xdp_program::xdp_program(std::string name, std::size_t queues, const std::vector<pref64> &prefixes)
+  : index(interface_index(name))
+  , map(make_xskmap(queues))
+  , prog(load_redirect(map.native(), prefixes))
+  , link(attach_generic(prog.native(), index))
+{
+}
+
+void
+xdp_program::attach(std::uint32_t queue, int xsk)
+{
+    const std::uint32_t value = xsk;
+    const int err = bpf(BPF_MAP_UPDATE_ELEM, designated((bpf_attr)) by
+    (
+      ((.map_fd = static_cast<std::uint32_t>(map.native())))
+      ((.key    = reinterpret_cast<std::uintptr_t>(&queue)))
+      ((.value  = reinterpret_cast<std::uintptr_t>(&value)))
+      ((.flags  = BPF_ANY))
+    ));
+    if (err < 0) { throw_with_errno(); }
+}
+
+
+xsk::xsk(xdp_program &prog, std::uint32_t queue)
+  : safe_desc(::socket(AF_XDP, SOCK_RAW, 0))
+{
+    static_assert((config::xsk_ring_size & (config::xsk_ring_size - 1)) == 0,
+                  "ring size should be power of 2");
+    static_assert(config::xsk_frame_count / 2 <= config::xsk_ring_size,
+                  "every RX frame should be able to sit on fill ring");
+
+    const std::size_t umem_size = config::xsk_frame_size * config::xsk_frame_count;
+    void *area = ::mmap(nullptr, umem_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (area == MAP_FAILED) { throw_with_errno(); }
+    umem = detail::mapping(area, detail::unmap_delete{umem_size});
+
+    const auto reg = designated((xdp_umem_reg)) by
+    (
+      ((.addr       = reinterpret_cast<std::uintptr_t>(area)))
+      ((.len        = umem_size))
+      ((.chunk_size = config::xsk_frame_size))
+    );
+    setsockopt(SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg));
+
+    const int ring_size = config::xsk_ring_size;
+    setsockopt(SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size));
+    setsockopt(SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size));
+    setsockopt(SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size));
+    setsockopt(SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size));
+
+    xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (::getsockopt(native(), SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) { throw_with_errno(); }
+
+    rx_map   = map_ring(native(), off.rx, XDP_PGOFF_RX_RING, rx);
+    tx_map   = map_ring(native(), off.tx, XDP_PGOFF_TX_RING, tx);
+    fill_map = map_ring(native(), off.fr, XDP_UMEM_PGOFF_FILL_RING, fill);
+    comp_map = map_ring(native(), off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, comp);
+
+    // The first half of frames are for RX, and the rest for TX.
+    constexpr std::uint32_t rx_frames = config::xsk_frame_count / 2;
+    for (std::uint32_t i = 0; i < rx_frames; ++i)
+    {
+        fill[i] = i * config::xsk_frame_size;
+    }
+    __atomic_store_n(fill.producer, rx_frames, __ATOMIC_RELEASE);
+
+    tx_free.reserve(config::xsk_frame_count - rx_frames);
+    for (std::uint32_t i = rx_frames; i < config::xsk_frame_count; ++i)
+    {
+        tx_free.push_back(i * config::xsk_frame_size);
+    }
+
+    // Generic mode never supports zero copy.
+    const auto sxdp = designated((sockaddr_xdp)) by
+    (
+      ((.sxdp_family   = AF_XDP))
+      ((.sxdp_flags    = XDP_COPY))
+      ((.sxdp_ifindex  = static_cast<std::uint32_t>(prog.ifindex())))
+      ((.sxdp_queue_id = queue))
+    );
+    if (::bind(native(), reinterpret_cast<const sockaddr *>(&sxdp), sizeof(sxdp)) < 0)
+    {
+        throw_with_errno();
+    }
+
+    prog.attach(queue, native());
+}
+
+bool
+xsk::receive(frame &f)
+{
+    const auto cons = *rx.consumer;
+    if (rx.cached == cons)
+    {
+        rx.cached = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+        if (rx.cached == cons) { return false; }
+    }
+
+    const auto &d = rx[cons];
+    f.addr = d.addr;
+    f.data = static_cast<char *>(umem.get()) + d.addr;
+    f.len  = d.len;
+    __atomic_store_n(rx.consumer, cons + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void
+xsk::release(const frame &f)
+{
+    // There is always room since fill ring can hold every RX frame.
+    const auto prod = *fill.producer;
+    fill[prod] = f.addr & ~std::uint64_t(config::xsk_frame_size - 1);
+    __atomic_store_n(fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+bool
+xsk::transmit(const iovec *iov, int iovcnt)
+{
+    std::size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) { len += iov[i].iov_len; }
+    if (len > config::xsk_frame_size) { return false; }
+
+    if (tx_free.empty()) { flush(); }
+    if (tx_free.empty()) { return false; }
+
+    const auto addr = tx_free.back();
+    tx_free.pop_back();
+
+    auto p = static_cast<char *>(umem.get()) + addr;
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        std::memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    // TX ring can hold every TX frame, too.
+    const auto prod = *tx.producer;
+    tx[prod] = designated((xdp_desc)) by
+    (
+      ((.addr = addr))
+      ((.len  = static_cast<std::uint32_t>(len)))
+    );
+    __atomic_store_n(tx.producer, prod + 1, __ATOMIC_RELEASE);
+    ++tx_pending;
+    return true;
+}
+
+void
+xsk::flush()
+{
+    // Generic mode transmits limited number of frames for each kick, then kick
+    // again while the kernel makes progress.
+    while (tx_pending)
+    {
+        const auto before = __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE);
+        if (::sendto(native(), nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0)
+        {
+            if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != EINTR)
+            {
+                throw_with_errno();
+            }
+        }
+        const auto after = __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE);
+        tx_pending -= after - before;
+        if (after == before) { break; }
+    }
+
+    complete();
+}
+
+void
+xsk::complete()
+{
+    auto cons = *comp.consumer;
+    const auto prod = __atomic_load_n(comp.producer, __ATOMIC_ACQUIRE);
+    for (; cons != prod; ++cons)
+    {
+        tx_free.push_back(comp[cons]);
+    }
+    __atomic_store_n(comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
 } // namespace shinano
@@ -8,15 +8,27 @@
 
 #include <utility>
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
 #include "detail/exception.hpp"
 #include "detail/designated_initializer.hpp"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_tun.h>
+#include <linux/if_xdp.h>
 #include "config.hpp"
+#include "detail/memory.hpp"
+#include "translate/pref64.hpp"
 
 #include <boost/assert.hpp>
+#include <boost/optional.hpp>
 
 namespace shinano { namespace detail {
 
@@ -87,6 +99,14 @@ struct writeable
         return write(buf.data(), buf.size());
     }
 
+    std::size_t
+    writev(const iovec *iov, int iovcnt)
+    {
+        auto err = ::writev(static_cast<Desc *>(this)->native(), iov, iovcnt);
+        if (err < 0) { throw_with_errno(); }
+        return err;
+    }
+
     template <typename A>
     std::size_t
     sendmsg(const iovec *iov, int iovcnt, const A &addr, int flags = 0)
@@ -112,6 +132,177 @@ struct writeable
     }
 };
 
+// Queue datagrams and send them by single sendmmsg(2). Each datagram is
+// copied into the arena, so that the caller can reuse its buffers as soon as
+// enqueue returns.
+//
+// Datagrams rejected by transient failure, e.g. ENOBUFS, are kept queued and
+// retried on next flush. If the queue is full, the oldest ones are dropped.
+// Datagrams rejected by themselves, e.g. no route to host, are dropped.
+template <typename Desc>
+struct batch_writeable
+{
+    batch_writeable()
+      : arena(config::egress_batch_bytes)
+      , msgs(config::egress_batch_depth)
+      , iovs(config::egress_batch_depth)
+      , names(config::egress_batch_depth)
+    {
+    }
+
+    template <typename A>
+    void
+    enqueue(const iovec *iov, int iovcnt, const A &addr)
+    {
+        enqueue(iov, iovcnt, &addr, sizeof(A));
+    }
+
+    template <int N, typename A>
+    void
+    enqueue(const iovec (&iov)[N], const A &addr)
+    {
+        enqueue(iov, N, &addr, sizeof(A));
+    }
+
+    void
+    enqueue(const iovec *iov, int iovcnt, const void *addr, socklen_t addrlen)
+    {
+        std::size_t len = 0;
+        for (int i = 0; i < iovcnt; ++i) { len += iov[i].iov_len; }
+        BOOST_ASSERT(len <= arena.size());
+        BOOST_ASSERT(addrlen <= sizeof(sockaddr_storage));
+
+        if (count == msgs.size() || used + len > arena.size())
+        {
+            flush();
+
+            std::size_t n = 0;
+            while (count - n == msgs.size() || used - offset(n) + len > arena.size()) { ++n; }
+            dropped_ += n;
+            discard(n);
+        }
+
+        auto p = arena.data() + used;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            std::memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        std::memcpy(&names[count], addr, addrlen);
+
+        iovs[count].iov_base = arena.data() + used;
+        iovs[count].iov_len  = len;
+        msgs[count].msg_hdr = designated((msghdr)) by
+        (
+          ((.msg_name = &names[count]))
+          ((.msg_namelen = addrlen))
+          ((.msg_iov = &iovs[count]))
+          ((.msg_iovlen = 1))
+        );
+
+        ++count;
+        used += len;
+
+        if (count == msgs.size()) { flush(); }
+    }
+
+    std::size_t
+    pending() const noexcept { return count; }
+
+    // True if last flush left datagrams queued by transient failure.
+    bool
+    backlogged() const noexcept { return stalled; }
+
+    std::uint64_t
+    retried() const noexcept { return retried_; }
+
+    std::uint64_t
+    dropped() const noexcept { return dropped_; }
+
+    // Returns false if some datagrams are left queued.
+    bool
+    flush()
+    {
+        std::size_t sent = 0;
+        stalled = false;
+        while (sent < count && !stalled)
+        {
+            auto err = ::sendmmsg(static_cast<Desc *>(this)->native(), &msgs[sent], count - sent, 0);
+            if (err >= 0)
+            {
+                sent += err;
+                continue;
+            }
+
+            switch (classify_send_error(errno))
+            {
+              case send_error::transient:
+                if (errno == EINTR) { continue; }
+                ++retried_;
+                stalled = true;
+                break;
+
+              case send_error::packet:
+                ++dropped_;
+                ++sent;
+                break;
+
+              case send_error::fatal:
+                count = used = 0;
+                throw_with_errno();
+            }
+        }
+        discard(sent);
+        return !stalled;
+    }
+
+private:
+    // Offset of n-th datagram in the arena.
+    std::size_t
+    offset(std::size_t n) const noexcept
+    {
+        if (n == count) { return used; }
+        return static_cast<const std::uint8_t *>(iovs[n].iov_base) - arena.data();
+    }
+
+    // Remove first `n` datagrams, and move the rest to the front.
+    void
+    discard(std::size_t n) noexcept
+    {
+        if (n == 0) { return; }
+
+        const auto off = offset(n);
+        std::memmove(arena.data(), arena.data() + off, used - off);
+        for (std::size_t i = n; i < count; ++i)
+        {
+            const auto j = i - n;
+            names[j] = names[i];
+            iovs[j].iov_base = static_cast<std::uint8_t *>(iovs[i].iov_base) - off;
+            iovs[j].iov_len  = iovs[i].iov_len;
+            msgs[j].msg_hdr = designated((msghdr)) by
+            (
+              ((.msg_name = &names[j]))
+              ((.msg_namelen = msgs[i].msg_hdr.msg_namelen))
+              ((.msg_iov = &iovs[j]))
+              ((.msg_iovlen = 1))
+            );
+        }
+        count -= n;
+        used  -= off;
+    }
+
+    std::vector<std::uint8_t>     arena;
+    std::vector<mmsghdr>          msgs;
+    std::vector<iovec>            iovs;
+    std::vector<sockaddr_storage> names;
+    std::size_t count = 0;
+    std::size_t used  = 0;
+
+    bool          stalled  = false;
+    std::uint64_t retried_ = 0;
+    std::uint64_t dropped_ = 0;
+};
+
 template <typename Desc>
 struct readable
 {
@@ -130,6 +321,49 @@ struct readable
     {
         return read(buf.data(), buf.size());
     }
+
+    // Same as read, but returns none instead of throwing if would block.
+    boost::optional<std::size_t>
+    try_read(void *buf, size_t len)
+    {
+        auto err = ::read(static_cast<Desc *>(this)->native(), buf, len);
+        if (err < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) { return boost::none; }
+            throw_with_errno();
+        }
+        return static_cast<std::size_t>(err);
+    }
+
+    template <typename B>
+    auto
+    try_read(B &buf)
+      -> decltype(this->try_read(buf.data(), buf.size()))
+    {
+        return try_read(buf.data(), buf.size());
+    }
+};
+
+template <typename Desc>
+struct pollable
+{
+    // Returns false if timed out or interrupted.
+    bool
+    poll(short events, int timeout = -1)
+    {
+        auto p = designated((pollfd)) by
+        (
+          ((.fd = static_cast<Desc *>(this)->native()))
+          ((.events = events))
+        );
+        int err = ::poll(&p, 1, timeout);
+        if (err < 0)
+        {
+            if (errno == EINTR) { return false; }
+            throw_with_errno();
+        }
+        return err > 0;
+    }
 };
 
 template <typename Desc>
@@ -157,6 +391,18 @@ struct controllable
         const int val = optval ? 1 : 0;
         setsockopt(level, optname, &val, sizeof(val));
     }
+
+    void
+    nonblocking(bool nb = true)
+    {
+        const int fd = static_cast<Desc *>(this)->native();
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0) { throw_with_errno(); }
+
+        if (nb) { flags |=  O_NONBLOCK; }
+        else    { flags &= ~O_NONBLOCK; }
+        if (::fcntl(fd, F_SETFL, flags) < 0) { throw_with_errno(); }
+    }
 };
 
 } // namespace shinano::detail::mixin
@@ -173,20 +419,49 @@ struct controle_socket : detail::safe_desc
 struct tuntap : detail::safe_desc
               , detail::mixin::controllable<tuntap>
               , detail::mixin::readable<tuntap>
+              , detail::mixin::writeable<tuntap>
+              , detail::mixin::pollable<tuntap>
 {
     static constexpr struct tap_tag {} tap = {};
     static constexpr struct tun_tag {} tun = {};
 
-    tuntap(tap_tag, std::string name);
-    tuntap(tun_tag, std::string name);
+    // Optional features of a queue, which are combined by bitwise or.
+    enum feature : int
+    {
+        // Attach one more queue to the interface. The interface should be
+        // created with multi_queue, e.g. `ip tuntap add dev <name> mode tun multi_queue`.
+        multi_queue = IFF_MULTI_QUEUE,
+
+        // Each packet is led by virtio_net_hdr (next to packet information),
+        // which carries GSO and checksum offload state.
+        vnet_hdr    = IFF_VNET_HDR,
+
+        // Written packets are received through NAPI, so that the kernel runs
+        // GRO over packets written back-to-back.
+        napi        = IFF_NAPI,
+    };
+
+    tuntap(tap_tag, std::string name, int features = 0);
+    tuntap(tun_tag, std::string name, int features = 0);
 
     void
     up(bool up = true);
 
+    std::size_t
+    mtu() const;
+
+    // Accept offloaded packets, i.e. TUN_F_* flags. Requires vnet_hdr.
+    void
+    offload(unsigned offloads);
+
+    bool
+    has_vnet_hdr() const noexcept { return flags & vnet_hdr; }
+
 private:
-    tuntap(int flag, std::string name);
+    tuntap(int flags, std::string name);
 
     int index;
+    int flags;
 };
 
 template <typename Tag, typename... Args>
@@ -196,10 +471,28 @@ make_tuntap(Args &&... args)
     return {Tag{}, std::forward<Args>(args)...};
 }
 
+// Open `n` queues of same interface. The kernel distributes flows among queues
+// by its flow hash, so each flow is kept on single queue.
+template <typename Tag>
+inline std::vector<tuntap>
+make_tuntap_queues(std::string name, std::size_t n, int features = 0)
+{
+    if (n > 1) { features |= tuntap::multi_queue; }
+
+    std::vector<tuntap> queues;
+    queues.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        queues.push_back(make_tuntap<Tag>(name, features));
+    }
+    return queues;
+}
+
 
 struct raw : detail::safe_desc
            , detail::mixin::controllable<raw>
            , detail::mixin::writeable<raw>
+           , detail::mixin::batch_writeable<raw>
 {
     static constexpr struct ipv4_tag {} ipv4 = {};
     static constexpr struct ipv6_tag {} ipv6 = {};
@@ -218,6 +511,87 @@ make_raw(Args &&... args)
     return {Tag{}, std::forward<Args>(args)...};
 }
 
+
+// XDP program in generic (SKB) mode which redirects frames to AF_XDP sockets
+// registered to each queue. IPv4 frames are always redirected, but IPv6 ones
+// only toward any of Pref64 prefixes, so that the kernel still answers ARP and
+// neighbor discovery on the interface. Detached when destroyed.
+struct xdp_program
+{
+    xdp_program(std::string name, std::size_t queues, const std::vector<pref64> &prefixes);
+
+    void
+    attach(std::uint32_t queue, int xsk);
+
+    int
+    ifindex() const noexcept { return index; }
+
+private:
+    int index;
+    detail::safe_desc map;
+    detail::safe_desc prog;
+    detail::safe_desc link;
+};
+
+namespace detail {
+
+template <typename T>
+struct xdp_ring
+{
+    std::uint32_t *producer;
+    std::uint32_t *consumer;
+    T *            ring;
+    std::uint32_t  mask;
+    std::uint32_t  cached;
+
+    T &
+    operator[](std::uint32_t i) noexcept { return ring[i & mask]; }
+};
+
+} // namespace shinano::detail
+
+// AF_XDP socket bound to a queue with its own UMEM. Received frames are handed
+// out in place in UMEM, and sent frames are copied into free TX frames.
+struct xsk : detail::safe_desc
+           , detail::mixin::controllable<xsk>
+           , detail::mixin::pollable<xsk>
+{
+    struct frame
+    {
+        std::uint64_t addr;
+        void *        data;
+        std::size_t   len;
+    };
+
+    xsk(xdp_program &prog, std::uint32_t queue);
+
+    // Take a received frame; it should be given back by release.
+    bool
+    receive(frame &f);
+
+    void
+    release(const frame &f);
+
+    // Returns false if the packet is dropped due to no room.
+    bool
+    transmit(const iovec *iov, int iovcnt);
+
+    // Kick TX and reap completed TX frames.
+    void
+    flush();
+
+private:
+    void
+    complete();
+
+    detail::mapping umem;
+    detail::mapping rx_map, tx_map, fill_map, comp_map;
+    detail::xdp_ring<xdp_desc>      rx, tx;
+    detail::xdp_ring<std::uint64_t> fill, comp;
+    std::vector<std::uint64_t> tx_free;
+    std::uint32_t tx_pending = 0;
+};
+
 } // namespace shinano
 
 #endif
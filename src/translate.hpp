@@ -7,15 +7,18 @@
 #define shinano_translate_hpp_
 
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <stdexcept>
 
 #include <iterator>
 #include <array>
+#include <linux/if_tun.h>
 
 #include "config.hpp"
 #include "util.hpp"
-#include "socket.hpp"
+#include "egress.hpp"
+#include "virtio_net.hpp"
 
 namespace shinano {
 
@@ -30,8 +33,10 @@ struct buffer_ref
 
     pointer   ptr_;
     size_type length_;
+    size_type headroom_; // writable bytes in front of ptr_
 
     size_type size() const noexcept { return length_; }
+    size_type headroom() const noexcept { return headroom_; }
     void resize(size_type newlen) noexcept { length_ = newlen; }
 
           iterator begin()       noexcept { return ptr_; }
@@ -62,7 +67,7 @@ struct buffer_ref
     buffer_ref
     next_to(size_type skip) noexcept
     {
-        return {data_as<value_type>(skip), size() - skip};
+        return {data_as<value_type>(skip), size() - skip, headroom() + skip};
     }
 
     template <typename T>
@@ -72,12 +77,48 @@ struct buffer_ref
 
 template <typename B>
 inline buffer_ref
-make_buffer_ref(B &b, std::size_t l) noexcept
+make_buffer_ref(B &b, std::size_t l, std::size_t headroom = 0) noexcept
 {
-    return {b.data(), l};
+    return {b.data() + headroom, l, headroom};
 }
 
-using input_buffer = std::array<std::uint8_t, IP_MAXPACKET>;
+// Size of buffer to read a packet up to `mtu` bytes. Packet is read at
+// config::input_headroom, and led by packet information and virtio_net_hdr.
+inline constexpr std::size_t
+input_buffer_size(std::size_t mtu = IP_MAXPACKET) noexcept
+{
+    return config::input_headroom + sizeof(tun_pi) + sizeof(virtio_net_hdr) + mtu;
+}
+
+// Move translated headers in front of the last iovec, which refers the rest of
+// original packet in `b`, so that the packet becomes single contiguous iovec.
+// Headers should be already copied out of `b`, since they are overwritten.
+// Returns new iovcnt, and room left in front of iov[0] is set to `headroom`.
+inline int
+rewrite_in_place(iovec *iov, int iovcnt, buffer_ref b, std::size_t &headroom) noexcept
+{
+    headroom = 0;
+
+    auto last = static_cast<std::uint8_t *>(iov[iovcnt - 1].iov_base);
+    if (last < b.begin() || b.end() < last + iov[iovcnt - 1].iov_len) { return iovcnt; }
+
+    std::size_t hlen = 0;
+    for (int i = 0; i < iovcnt - 1; ++i) { hlen += iov[i].iov_len; }
+
+    const std::size_t room = b.headroom() + (last - b.begin());
+    if (room < hlen) { return iovcnt; }
+
+    auto p = last;
+    for (int i = iovcnt - 1; i--; )
+    {
+        p -= iov[i].iov_len;
+        std::memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    }
+    iov[0].iov_base = p;
+    iov[0].iov_len  = hlen + iov[iovcnt - 1].iov_len;
+    headroom = room - hlen;
+    return 1;
+}
 
 
 struct translate_error : std::runtime_error
@@ -85,9 +126,11 @@ struct translate_error : std::runtime_error
     using std::runtime_error::runtime_error;
 };
 
+// `vnet` is offload state of the packet, if any. It is rewritten for the
+// translated packet and passed to the egress.
 template <typename Target>
 bool
-translate(std::reference_wrapper<raw>, buffer_ref);
+translate(std::reference_wrapper<egress>, buffer_ref, virtio_net_hdr *vnet = nullptr);
 
 struct translate_aborted : std::exception
 {
@@ -110,19 +153,26 @@ private:
 };
 
 template <typename... T>
-inline void
+[[noreturn]] inline void
 translate_break(T &&... v)
 {
     throw translate_aborted(std::forward<T>(v)...);
 }
 
 
+// Whether each translated packet is printed, which is on by default. Should
+// be set before workers start.
 void
-temporary_table_init();
-const in6_addr &
-temporary_prefix() noexcept;
-std::size_t
-temporary_plen() noexcept;
+temporary_show_detail(bool show) noexcept;
+
+bool
+temporary_show_detail() noexcept;
+
+// Table is placed on shared memory named `segment` if given, and the table
+// left there by the last run is taken over unless `discard`, which is
+// returned. napt_init, pref64_init and v4pool_init should be called before.
+bool
+temporary_table_init(const char *segment = nullptr, bool discard = false);
 
 } // namespace shinano
 
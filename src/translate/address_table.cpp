@@ -3,161 +3,1376 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <ctime>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-
-#include <boost/icl/interval_set.hpp>
-using namespace boost::icl;
-
-#include <iterator>
-#include <deque>
-#include <boost/range/algorithm/find_if.hpp>
-#include <boost/range/algorithm/remove_if.hpp>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "detail/exception.hpp"
 #include "detail/designated_initializer.hpp"
+#include "detail/bitmap_pool.hpp"
+#include "detail/bucket_map.hpp"
+#include "detail/memory.hpp"
+#include "detail/siphash.hpp"
+#include "socket.hpp"
 
-#include "translate.hpp"
+#include <boost/assert.hpp>
 
-#include <iostream>
+#include "translate.hpp"
+#include "translate/address_table.hpp"
 
 namespace shinano {
 
 namespace {
 
-using clock      = std::chrono::steady_clock;
-using time_point = clock::time_point;
+constexpr std::uint32_t nil = 0xffffffffu;
 
+// Binding passed in and out of shards, which store each field in its own
+// array.
 struct nat_entry
 {
-    in_addr    v4add;
-    in6_addr   v6add;
-    time_point updated_at;
+    in_addr       v4add; // 0.0.0.0 if the entry is vacant
+    in6_addr      v6add;
+    std::uint16_t v4port;     // NAPT only, in network order
+    std::uint16_t v6port;     // NAPT only, in network order
+    std::uint8_t  proto;      // protocol of NAPT binding, or 0
+    std::uint8_t  pref;       // index of Pref64
+    std::uint32_t updated_at; // in coarse seconds
 };
 
-std::deque<nat_entry> table;
+struct napt_ports
+{
+    std::uint16_t v4; // in network order
+    std::uint16_t v6; // in network order
+};
 
-// Store v4 address in host order.
-interval_set<decltype(in_addr::s_addr)> free_list;
+struct napt_key6
+{
+    in6_addr      addr;
+    std::uint16_t port;
+    std::uint8_t  proto;
+    std::uint8_t  _padding;
+};
 
-in6_addr prefix;
-std::size_t prefix_len;
+struct napt_key4
+{
+    in_addr       addr;
+    std::uint16_t port;
+    std::uint8_t  proto;
+    std::uint8_t  _padding;
+};
 
-void
-reclaim()
+// The table is laid out on single mapping, which may be shared memory left by
+// the last run: table_header, then the same layout for each shard. Every
+// part is plain data without pointers, so that it can be mapped anywhere.
+// Bump `layout_version` whenever the layout changes.
+constexpr char          layout_magic[8] = "shinano";
+constexpr std::uint32_t layout_version  = 7;
+constexpr std::size_t   cache_line      = 64;
+
+struct table_header
+{
+    char          magic[8];
+    std::uint64_t length; // of whole mapping
+
+    // Geometry, which should match to take the table over.
+    std::uint32_t version;
+    std::uint32_t shards;
+    std::uint32_t wheel_slots;
+    std::uint32_t capacity;  // entries per shard
+    std::uint32_t napt_base; // in host order
+    std::uint32_t napt_size; // 0 if stateless
+    std::uint64_t pools;     // digest of v4 pools, whose parts are in shards
+    std::uint64_t prefixes;  // digest of Pref64 list, whose index is in entries
+
+    // CLOCK_MONOTONIC_COARSE when the table was created, which is the origin
+    // of timestamps in entries.
+    std::int64_t    epoch;
+    detail::siphash sharding; // picks shard of stateless entries
+    detail::siphash pairing;  // picks NAPT address of v6 hosts
+};
+
+struct shard_header
 {
-    const auto now = clock::now();
-    auto i = boost::remove_if(table, [&](const nat_entry &e)
+    std::atomic<std::uint32_t> cursor; // next tick to process
+    std::uint32_t used;      // entries used ever
+    std::uint32_t vacant;    // head of vacant entries linked by `next`, or nil
+    std::uint32_t lent;      // hosts of this shard bound by other shards
+    std::uint32_t wheel[config::table_wheel_slots];
+};
+
+// Offsets of parts in a shard.
+struct shard_layout
+{
+    std::size_t v4add;
+    std::size_t v6add;
+    std::size_t updated;
+    std::size_t next;
+    std::size_t generation;
+    std::size_t ports;
+    std::size_t proto;
+    std::size_t pref;
+    std::size_t by_v4;
+    std::size_t free;
+    std::size_t bound;
+    std::size_t by_v6;
+    std::size_t by_ep6;
+    std::size_t by_ep4;
+    std::size_t size;
+};
+
+std::size_t
+round_up(std::size_t n, std::size_t unit) noexcept
+{
+    return (n + unit - 1) / unit * unit;
+}
+
+// Seconds since the table was created, which is updated by table_tick.
+std::atomic<std::uint32_t> now;
+
+// Entries are scheduled into the wheel by their deadline, in units of `width`
+// seconds. Touching an entry doesn't reschedule it; the deadline is checked
+// when its slot comes, and the entry is scheduled again if it was touched.
+// Slots cover longer than config::table_expires_after. An entry due after a
+// revolution, e.g. NAPT TCP binding, or an entry of a lagging wheel is put into
+// the last slot before the cursor instead, so that it comes early and is
+// scheduled again, at most once per revolution, until its deadline comes.
+constexpr std::uint32_t width =
+    (config::table_expires_after.count() + config::table_wheel_slots - 2) / (config::table_wheel_slots - 1);
+
+// NAPT shards are picked by lower bits of v4 port, which are kept on binding.
+static_assert(1024 % config::table_shards == 0, "shards should divide well-known ports");
+
+table_header *  header;
+detail::mapping segment;
+detail::safe_desc segment_desc; // locked while the segment is in use
+
+// Each stateless pool is split into contiguous parts, one for each shard;
+// the last ones may be shorter or empty. Parts owned by a shard are laid out
+// one after another in its `by_v4` and `free`.
+struct pool_geometry
+{
+    std::uint32_t base; // in host order
+    std::uint32_t size;
+    std::uint32_t part; // addresses owned by each shard
+    std::uint32_t at;   // of the part in `by_v4`
+    std::size_t   free; // offset of the bitmap of the part in `free`
+};
+
+std::vector<pool_geometry> geometry; // by pool
+std::uint32_t              v4_slots; // addresses owned by each shard in total
+std::size_t                free_size;
+
+// NAPT pool is [napt_base, napt_base + napt_size) in host order.
+bool          napt;
+std::uint32_t napt_base;
+std::uint32_t napt_size;
+
+std::uint32_t
+coarse_seconds() noexcept
+{
+    timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec - header->epoch;
+}
+
+// Lifetime of an entry after last use.
+std::uint32_t
+lifetime(std::uint8_t proto) noexcept
+{
+    switch (static_cast<iana::protocol_number>(proto))
     {
-        return (now - e.updated_at) > config::table_expires_after;
-    });
+      case iana::protocol_number::tcp:  return config::napt_tcp_expires_after.count();
+      case iana::protocol_number::udp:  return config::napt_udp_expires_after.count();
+      case iana::protocol_number::icmp: return config::napt_icmp_expires_after.count();
+      default:                          return config::table_expires_after.count();
+    }
+}
 
-    std::cout << "reclaim " << std::distance(i, table.end()) << " table entries." << std::endl;;
+napt_key6
+key6(const nat_entry &e) noexcept
+{
+    return designated((napt_key6)) by
+    (
+      ((.addr  = e.v6add))
+      ((.port  = e.v6port))
+      ((.proto = e.proto))
+    );
+}
+
+napt_key4
+key4(const nat_entry &e) noexcept
+{
+    return designated((napt_key4)) by
+    (
+      ((.addr  = e.v4add))
+      ((.port  = e.v4port))
+      ((.proto = e.proto))
+    );
+}
+
+// Where a stateless pool address is owned.
+struct v4_owner
+{
+    std::uint32_t shard; // or config::table_shards if out of the pools
+    std::uint32_t pool;
+    std::uint32_t offset; // in the part of the pool
+};
 
-    table.erase(i, table.end());
+v4_owner
+owner_of(const in_addr &address) noexcept
+{
+    const auto p = v4pool_find(address);
+    if (p == v4pool_none) { return {config::table_shards, 0, 0}; }
+
+    const auto &g = geometry[p];
+    const auto offset = net_to_host(address.s_addr) - g.base;
+    return {offset / g.part, p, offset % g.part};
 }
 
+// Part of a stateless pool owned by a shard.
+struct pool_part
+{
+    std::uint32_t base; // in host order
+    std::uint32_t len;
+
+    // Unbound addresses by offset from `base`.
+    detail::bitmap_pool free;
+
+    // Addresses bound, which is read without the lock.
+    std::atomic<std::uint32_t> * bound;
+};
+
+struct shard;
+
+shard &
+shard_of(const in6_addr &address) noexcept;
 
-decltype(table)::iterator
-allocate_v4address()
+// Part of the table which is locked independently. Stateless entries are put
+// into the shard by keyed hash of v6 address, and each shard owns contiguous
+// part of the pool, so that both directions find the shard without a lock.
+// A host whose shard has run out of the part is bound by other shard which
+// owns the address, and its own shard indexes it to that one.
+// NAPT bindings are put by lower bits of v4 port instead, which is picked to
+// keep them of v6 port. Either way, new entry takes only its shard's lock.
+//
+// The lock is kept out of the mapping, so that a crashed run never leaves it
+// held.
+struct alignas(64) shard
 {
-    auto i = free_list.begin();
-    if (i == free_list.end())
+    std::mutex mutex;
+
+    std::uint32_t  id;
+    shard_header * state;
+    std::uint32_t  capacity;
+
+    // Entries are slots of parallel arrays, so that each path touches only
+    // fields it uses: lookups read an address and write `updated`, and the
+    // wheel walks `updated` and `next`.
+    in_addr *       v4add;   // 0.0.0.0 if the slot is vacant
+    in6_addr *      v6add;
+    std::uint32_t * updated; // in coarse seconds
+    std::uint32_t * next;    // next slot in same wheel slot, or vacant list
+    napt_ports *    ports;   // NAPT only
+    std::uint8_t *  proto;   // NAPT only
+    std::uint8_t *  pref;    // index of Pref64 the host reaches v4 through
+
+    // Stateless only. Bumped whenever the slot expires, so that a handle
+    // never refers to other binding which took the slot later. Read by hits
+    // of flow caches without the lock.
+    std::atomic<std::uint32_t> * generation;
+
+    // Entries are indexed by both sides. v6 side is hashed, and v4 side is an
+    // array over the parts of the pools. Both hold entry index + 1, or v6
+    // side holds lent_to(shard) for a host bound by other shard. v6 side has
+    // room for as many of them as entries.
+    detail::bucket_map<in6_addr> by_v6;
+    std::uint32_t *              by_v4; // or 0 if unbound
+    std::vector<pool_part>       parts; // by pool
+
+    // NAPT bindings are indexed by endpoints of both sides instead.
+    detail::bucket_map<napt_key6> by_ep6;
+    detail::bucket_map<napt_key4> by_ep4;
+
+    // Attach to `area`, which is zero filled if `fresh`.
+    void
+    attach(std::uint8_t *area, const shard_layout &l, std::uint32_t capacity, bool fresh)
     {
-        auto ex = translate_error("translate v6 to v4 failed: failed to allocate v4 address");
-        detail::throw_exception(ex);
+        this->state    = reinterpret_cast<shard_header *>(area);
+        this->capacity = capacity;
+        this->v4add    = reinterpret_cast<in_addr *>(area + l.v4add);
+        this->v6add    = reinterpret_cast<in6_addr *>(area + l.v6add);
+        this->updated  = reinterpret_cast<std::uint32_t *>(area + l.updated);
+        this->next     = reinterpret_cast<std::uint32_t *>(area + l.next);
+        this->pref     = area + l.pref;
+        this->by_v4    = reinterpret_cast<std::uint32_t *>(area + l.by_v4);
+        if (napt)
+        {
+            ports  = reinterpret_cast<napt_ports *>(area + l.ports);
+            proto  = reinterpret_cast<std::uint8_t *>(area + l.proto);
+            by_ep6 = detail::bucket_map<napt_key6>(area + l.by_ep6, capacity);
+            by_ep4 = detail::bucket_map<napt_key4>(area + l.by_ep4, capacity);
+        }
+        else
+        {
+            generation = reinterpret_cast<std::atomic<std::uint32_t> *>(area + l.generation);
+            by_v6 = detail::bucket_map<in6_addr>(area + l.by_v6, 2 * capacity);
+
+            const auto bound = reinterpret_cast<std::atomic<std::uint32_t> *>(area + l.bound);
+            parts.clear();
+            for (std::size_t p = 0; p < geometry.size(); ++p)
+            {
+                const auto &g = geometry[p];
+                const auto offset = std::min(id * g.part, g.size);
+                const auto len    = std::min(g.part, g.size - offset);
+                parts.push_back(pool_part{g.base + offset, len,
+                                          detail::bitmap_pool(area + l.free + g.free, len, fresh), &bound[p]});
+
+                // The first and last addresses of the pool are never bound.
+                auto &part = parts.back();
+                if (!fresh || len == 0) { continue; }
+                if (offset == 0) { part.free.take(0); }
+                if (offset + len == g.size) { part.free.take(len - 1); }
+            }
+        }
+        if (!fresh) { return; }
+
+        state->vacant = nil;
+        std::fill(std::begin(state->wheel), std::end(state->wheel), nil);
+    }
+
+    nat_entry
+    entry(std::uint32_t index) const noexcept
+    {
+        return designated((nat_entry)) by
+        (
+          ((.v4add  = v4add[index]))
+          ((.v6add  = v6add[index]))
+          ((.v4port = napt ? ports[index].v4 : 0))
+          ((.v6port = napt ? ports[index].v6 : 0))
+          ((.proto  = napt ? proto[index] : 0))
+          ((.pref   = pref[index]))
+          ((.updated_at = updated[index]))
+        );
+    }
+
+    // `o` should be owned by this shard.
+    std::uint32_t &
+    find_v4(const v4_owner &o) noexcept
+    {
+        return by_v4[geometry[o.pool].at + o.offset];
+    }
+
+    void
+    schedule(std::uint32_t index, std::uint32_t deadline) noexcept
+    {
+        // Entry due in current tick waits for next one, which is not processed
+        // yet. Entry due after a revolution takes the last slot before the
+        // current one, so that it never joins the slot being walked.
+        const std::uint32_t cursor = state->cursor;
+        const auto tick = std::min<std::uint32_t>(std::max(deadline / width, cursor + 1),
+                                                  cursor + config::table_wheel_slots - 1);
+        BOOST_ASSERT(tick % config::table_wheel_slots != cursor % config::table_wheel_slots);
+        auto &head = state->wheel[tick % config::table_wheel_slots];
+        next[index] = head;
+        head = index;
     }
 
-    auto v = i->lower();
-    if (i->bounds() == interval_bounds::open()
-     || i->bounds() == interval_bounds::left_open())
+    // Returns false if the entry is kept, since it is of a host lent by other
+    // shard which is busy. The shard is only tried to lock, as it may be
+    // waiting for this one.
+    bool
+    expire(std::uint32_t index)
     {
-        // in the case of (v, X) or (v, X]
-        ++v;
+        if (napt)
+        {
+            // NAPT address is shared by other bindings.
+            const auto e = entry(index);
+            by_ep6.erase(key6(e));
+            by_ep4.erase(key4(e));
+        }
+        else
+        {
+            auto &home = shard_of(v6add[index]);
+            if (&home != this)
+            {
+                std::unique_lock<std::mutex> lock(home.mutex, std::try_to_lock);
+                if (!lock) { return false; }
+
+                home.by_v6.erase(v6add[index]);
+                --home.state->lent;
+            }
+
+            const auto o = owner_of(v4add[index]);
+            by_v6.erase(v6add[index]);
+            find_v4(o) = 0;
+            parts[o.pool].free.free(o.offset);
+            parts[o.pool].bound->fetch_sub(1, std::memory_order_relaxed);
+            generation[index].fetch_add(1, std::memory_order_relaxed);
+        }
+        v4add[index].s_addr = 0;
+        next[index] = state->vacant;
+        state->vacant = index;
+        return true;
     }
+
+    // Process due slots of the wheel, until `budget` runs out.
+    void
+    advance(std::uint32_t t, std::size_t &budget)
+    {
+        for (; state->cursor <= t / width; ++state->cursor)
+        {
+            // Detach the slot while it is walked, and put the rest back if the
+            // budget runs out.
+            auto &head = state->wheel[state->cursor % config::table_wheel_slots];
+            auto list = head;
+            head = nil;
+            while (list != nil)
+            {
+                if (budget == 0)
+                {
+                    BOOST_ASSERT(head == nil);
+                    head = list;
+                    return;
+                }
+                --budget;
+
+                // Signed, since other worker may have touched it with newer clock.
+                const auto i = list;
+                list = next[i];
+
+                const auto expires = lifetime(napt ? proto[i] : 0);
+                if (static_cast<std::int32_t>(expires) > static_cast<std::int32_t>(t - updated[i])) { schedule(i, updated[i] + expires); }
+                else if (!expire(i)) { schedule(i, t); }
+            }
+        }
+    }
+
+    // Store new entry, and schedule its expiry.
+    std::uint32_t
+    emplace(const nat_entry &e)
+    {
+        std::uint32_t index;
+        if (state->vacant != nil)
+        {
+            index = state->vacant;
+            state->vacant = next[index];
+        }
+        else if (state->used < capacity)
+        {
+            index = state->used++;
+        }
+        else
+        {
+            auto ex = translate_error("translate v6 to v4 failed: NAT table is full");
+            detail::throw_exception(ex);
+        }
+        v4add[index]   = e.v4add;
+        v6add[index]   = e.v6add;
+        updated[index] = e.updated_at;
+        pref[index]    = e.pref;
+        if (napt)
+        {
+            ports[index] = napt_ports{e.v4port, e.v6port};
+            proto[index] = e.proto;
+        }
+        schedule(index, e.updated_at + lifetime(e.proto));
+        return index;
+    }
+
+    // Keep `p` in the entry unless pref64_none.
+    void
+    touch(std::uint32_t index, std::uint32_t p) noexcept
+    {
+        updated[index] = now.load(std::memory_order_relaxed);
+        if (p == pref64_none || pref[index] == p) { return; }
+
+        // Cached headers of replies embed the prefix.
+        pref[index] = p;
+        if (!napt) { generation[index].fetch_add(1, std::memory_order_relaxed); }
+    }
+
+    // Bind `address` to an address of the part of pool `p`. Returns index of
+    // new entry, or nil if the part is exhausted.
+    std::uint32_t
+    bind_v4address(const in6_addr &address, std::uint32_t p);
+
+    // Returns index of new entry, whose Pref64 is set by touch.
+    std::uint32_t
+    allocate_endpoint(const napt_key6 &k);
+};
+
+shard shards[config::table_shards];
+
+shard &
+shard_of(const in6_addr &address) noexcept
+{
+    return shards[header->sharding(&address, sizeof(address)) & (config::table_shards - 1)];
+}
+
+// `port` is in network order.
+shard &
+shard_of(std::uint16_t port) noexcept
+{
+    return shards[net_to_host(port) & (config::table_shards - 1)];
+}
+
+// by_v6 of the shard of a host holds lent_to(id) if the host is bound by
+// shard `id`, which is above any entry index + 1.
+constexpr std::uint32_t lent_base = detail::bucket_map<in6_addr>::max_value - (config::table_shards - 1);
+
+constexpr std::uint32_t
+lent_to(std::uint32_t id) noexcept
+{
+    return lent_base + id;
+}
+
+std::uint32_t
+shard::bind_v4address(const in6_addr &address, std::uint32_t p)
+{
+    auto &part = parts[p];
+    const auto offset = part.len ? part.free.allocate() : part.free.npos;
+    if (offset == part.free.npos) { return nil; }
+
     // XXX: Should validate v4 here.
-    table.emplace_back(designated((nat_entry)) by
+    const auto e = designated((nat_entry)) by
     (
-      ((.v4add.s_addr = host_to_net(v)))
-    ));
-    free_list -= v;
+      ((.v4add.s_addr = host_to_net<std::uint32_t>(part.base + offset)))
+      ((.v6add = address))
+      ((.updated_at = now.load(std::memory_order_relaxed)))
+    );
+
+    // Never full, since the shard holds as many entries as its addresses.
+    const auto index = emplace(e);
+    by_v6.insert(address, index + 1);
+    by_v4[geometry[p].at + offset] = index + 1;
+    part.bound->fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+// Called under the lock of `home`, which is the shard of `address`. `use`
+// takes the shard and index of new entry under its lock, and its result is
+// returned.
+template <typename Use>
+auto
+allocate_v4address(shard &home, const in6_addr &address, Use use) -> decltype(use(home, 0))
+{
+    // Pools of the host are tried from one picked by weight, which is same
+    // for the host as long as it has room.
+    const auto c = v4pool_select(address, header->pairing(&address, sizeof(address)));
+    if (c.count == 0)
+    {
+        auto ex = translate_error("translate v6 to v4 failed: no v4 pool serves the host");
+        detail::throw_exception(ex);
+    }
+
+    for (std::uint32_t k = 0; k < c.count; ++k)
+    {
+        const auto p = c.pools[(c.first + k) % c.count];
+        const auto index = home.bind_v4address(address, p);
+        if (index != nil) { return use(home, index); }
+
+        // Exhausted part is backed by parts of other shards, as long as `home`
+        // has room to index the host. Other shards are only tried to lock,
+        // since one of them may be waiting for `home`.
+        for (std::uint32_t n = 1; n < config::table_shards && home.state->lent < home.capacity; ++n)
+        {
+            auto &s = shards[(home.id + n) % config::table_shards];
+            std::unique_lock<std::mutex> lock(s.mutex, std::try_to_lock);
+            if (!lock) { continue; }
+
+            const auto index = s.bind_v4address(address, p);
+            if (index == nil) { continue; }
+
+            home.by_v6.insert(address, lent_to(s.id));
+            ++home.state->lent;
+            return use(s, index);
+        }
+    }
+
+    auto ex = translate_error("translate v6 to v4 failed: failed to allocate v4 address");
+    detail::throw_exception(ex);
+}
+
+std::uint32_t
+shard::allocate_endpoint(const napt_key6 &k)
+{
+    // Every binding of a host takes same address, i.e. "paired" address
+    // pooling in RFC 6146 section 3.5.1.1.
+    in_addr addr;
+    addr.s_addr = host_to_net<std::uint32_t>(napt_base + header->pairing(&k.addr, sizeof(k.addr)) % napt_size);
+
+    // Keep the port if possible, otherwise probe following ports which fall
+    // into this shard.
+    std::uint16_t port = net_to_host(k.port);
+    for (std::size_t i = 0; i < config::napt_port_probes; ++i, port += config::table_shards)
+    {
+        if (port < 1024) { port = 1024 | (port & (config::table_shards - 1)); }
+
+        auto key = designated((napt_key4)) by
+        (
+          ((.addr  = addr))
+          ((.port  = host_to_net(port)))
+          ((.proto = k.proto))
+        );
+        if (by_ep4.find(key)) { continue; }
+
+        const auto index = emplace(designated((nat_entry)) by
+        (
+          ((.v4add  = addr))
+          ((.v6add  = k.addr))
+          ((.v4port = key.port))
+          ((.v6port = k.port))
+          ((.proto  = k.proto))
+          ((.updated_at = now.load(std::memory_order_relaxed)))
+        ));
+        by_ep6.insert(k, index + 1);
+        by_ep4.insert(key, index + 1);
+        return index;
+    }
+
+    auto ex = translate_error("translate v6 to v4 failed: failed to allocate port");
+    detail::throw_exception(ex);
+}
+
+shard_layout
+layout_of(std::uint32_t capacity) noexcept
+{
+    shard_layout l;
+    auto offset = round_up(sizeof(shard_header), cache_line);
+    auto part = [&](std::size_t &at, std::size_t len)
+    {
+        at = offset;
+        offset += round_up(len, cache_line);
+    };
+    part(l.v4add,      capacity * sizeof(in_addr));
+    part(l.v6add,      capacity * sizeof(in6_addr));
+    part(l.updated,    capacity * sizeof(std::uint32_t));
+    part(l.next,       capacity * sizeof(std::uint32_t));
+    part(l.generation, napt ? 0 : capacity * sizeof(std::atomic<std::uint32_t>));
+    part(l.ports,      napt ? capacity * sizeof(napt_ports) : 0);
+    part(l.proto,      napt ? capacity * sizeof(std::uint8_t) : 0);
+    part(l.pref,       capacity * sizeof(std::uint8_t));
+    part(l.by_v4,  napt ? 0 : v4_slots * sizeof(std::uint32_t));
+    part(l.free,   napt ? 0 : free_size);
+    part(l.bound,  napt ? 0 : geometry.size() * sizeof(std::atomic<std::uint32_t>));
+    part(l.by_v6,  napt ? 0 : detail::bucket_map<in6_addr>::footprint(2 * capacity));
+    part(l.by_ep6, napt ? detail::bucket_map<napt_key6>::footprint(capacity) : 0);
+    part(l.by_ep4, napt ? detail::bucket_map<napt_key4>::footprint(capacity) : 0);
+    l.size = offset;
+    return l;
+}
+
+bool
+same_geometry(const table_header &a, const table_header &b) noexcept
+{
+    return std::equal(std::begin(a.magic), std::end(a.magic), std::begin(b.magic))
+        && a.length      == b.length
+        && a.version     == b.version
+        && a.shards      == b.shards
+        && a.wheel_slots == b.wheel_slots
+        && a.capacity    == b.capacity
+        && a.napt_base   == b.napt_base
+        && a.napt_size   == b.napt_size
+        && a.pools       == b.pools
+        && a.prefixes    == b.prefixes;
+}
+
+// Map the table on anonymous memory, or on shared memory named `name`. The
+// table left there is taken over if its geometry matches to `want`, unless
+// `fresh` is set; otherwise the mapping is zero filled, and `fresh` is set.
+void
+map_table(const char *name, const table_header &want, bool &fresh)
+{
+    const auto len = want.length;
+    const bool discard = fresh;
+    if (!name)
+    {
+        void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) { throw_with_errno(); }
+
+        fresh   = true;
+        segment = detail::mapping(p, detail::unmap_delete{len});
+        header  = static_cast<table_header *>(p);
+        return;
+    }
+
+    const auto path = (name[0] == '/' ? "" : "/") + std::string(name);
+    detail::safe_desc fd(::shm_open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+    // Only one process may update the table at once.
+    if (::flock(fd.native(), LOCK_EX | LOCK_NB) < 0)
+    {
+        if (errno != EWOULDBLOCK) { throw_with_errno(); }
+        detail::throw_exception(std::runtime_error("NAT table " + path + " is in use by other process"));
+    }
+
+    struct stat st;
+    table_header old;
+    if (::fstat(fd.native(), &st) < 0) { throw_with_errno(); }
+    fresh = discard || !(static_cast<std::size_t>(st.st_size) == len
+           && ::pread(fd.native(), &old, sizeof(old), 0) == sizeof(old)
+           && same_geometry(old, want));
+    if (fresh)
+    {
+        // Truncate first to drop the last contents.
+        if (::ftruncate(fd.native(), 0) < 0
+         || ::ftruncate(fd.native(), len) < 0)
+        {
+            throw_with_errno();
+        }
+    }
+
+    void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_NORESERVE, fd.native(), 0);
+    if (p == MAP_FAILED) { throw_with_errno(); }
 
-    return std::prev(table.end());
+    segment      = detail::mapping(p, detail::unmap_delete{len});
+    segment_desc = std::move(fd);
+    header       = static_cast<table_header *>(p);
+}
+
+// Snapshot is the header, a block of Pref64 list and a stream of blocks of
+// entries, which ends with an empty block. Each of them is followed by a
+// checksum, which is keyed by the previous one, so that lost or reordered
+// blocks are also detected.
+// Integers are in network order.
+constexpr char          snapshot_magic[8] = "shnsnap";
+constexpr std::uint32_t snapshot_version  = 3;
+constexpr std::size_t   snapshot_block    = 4096; // entries at most
+
+struct snapshot_header
+{
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t napt_size; // 0 if stateless
+    std::uint32_t napt_base;
+    std::uint32_t _padding;
+    std::uint64_t keys[4];   // of sharding and pairing
+};
+
+struct snapshot_entry
+{
+    in6_addr      v6add;
+    in_addr       v4add;
+    std::uint16_t v6port;
+    std::uint16_t v4port;
+    std::uint8_t  proto;
+    std::uint8_t  pref; // index in the Pref64 list of the snapshot
+    std::uint8_t  _padding[2];
+    std::uint32_t idle; // seconds since last use
+};
+static_assert(sizeof(snapshot_entry) == 32, "snapshot entry should be packed");
+
+// Pref64 as written in snapshots, which also identifies the list for the
+// table header.
+struct prefix_record
+{
+    in6_addr     prefix;
+    std::uint8_t plen;
+    std::uint8_t _padding[3];
+};
+
+std::vector<prefix_record>
+prefix_records()
+{
+    std::vector<prefix_record> records;
+    for (const auto &p : pref64_all())
+    {
+        records.push_back(designated((prefix_record)) by
+        (
+          ((.prefix = p.prefix))
+          ((.plen   = static_cast<std::uint8_t>(p.plen)))
+        ));
+    }
+    return records;
+}
+
+std::uint64_t
+prefix_digest()
+{
+    const auto records = prefix_records();
+    return detail::siphash{0, 0}(records.data(), records.size() * sizeof(prefix_record));
+}
+
+void
+write_all(int fd, const void *buf, std::size_t len)
+{
+    auto p = static_cast<const std::uint8_t *>(buf);
+    while (len)
+    {
+        const auto n = ::write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) { continue; }
+            throw_with_errno();
+        }
+        p   += n;
+        len -= n;
+    }
+}
+
+// Tells whether nothing follows, i.e. the snapshot is not longer than it says.
+bool
+read_end(int fd)
+{
+    std::uint8_t c;
+    for (;;)
+    {
+        const auto n = ::read(fd, &c, sizeof(c));
+        if (n >= 0) { return n == 0; }
+        if (errno != EINTR) { throw_with_errno(); }
+    }
+}
+
+// Makes rename of the file durable, by syncing the directory containing it.
+void
+sync_directory(const char *path)
+{
+    const std::string name(path);
+    const auto slash = name.rfind('/');
+    const auto dir = slash == std::string::npos ? std::string(".") : slash == 0 ? std::string("/") : name.substr(0, slash);
+    detail::safe_desc fd(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (::fsync(fd.native()) < 0) { throw_with_errno(); }
+}
+
+void
+read_all(int fd, void *buf, std::size_t len)
+{
+    auto p = static_cast<std::uint8_t *>(buf);
+    while (len)
+    {
+        const auto n = ::read(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) { continue; }
+            throw_with_errno();
+        }
+        if (n == 0) { detail::throw_exception(std::runtime_error("snapshot is truncated")); }
+        p   += n;
+        len -= n;
+    }
+}
+
+// Writes blocks with chained checksums, or verifies them.
+struct snapshot_stream
+{
+    int           fd;
+    std::uint64_t sum;
+
+    std::uint64_t
+    chain(const void *data, std::size_t len) noexcept
+    {
+        return sum = detail::siphash{sum, 0}(data, len);
+    }
+
+    void
+    put(const void *data, std::size_t len)
+    {
+        const auto c = host_to_net(chain(data, len));
+        write_all(fd, data, len);
+        write_all(fd, &c, sizeof(c));
+    }
+
+    // Verify `data`, which is read by the caller, against following checksum.
+    void
+    check(const void *data, std::size_t len)
+    {
+        std::uint64_t c;
+        read_all(fd, &c, sizeof(c));
+        if (net_to_host(c) != chain(data, len))
+        {
+            detail::throw_exception(std::runtime_error("snapshot is corrupted"));
+        }
+    }
+};
+
+snapshot_entry
+to_snapshot(const nat_entry &e, std::uint32_t t) noexcept
+{
+    return designated((snapshot_entry)) by
+    (
+      ((.v6add  = e.v6add))
+      ((.v4add  = e.v4add))
+      ((.v6port = e.v6port))
+      ((.v4port = e.v4port))
+      ((.proto  = e.proto))
+      ((.pref   = e.pref))
+      ((.idle   = host_to_net<std::uint32_t>(std::max<std::int32_t>(t - e.updated_at, 0))))
+    );
+}
+
+// Put the entry directly into its shard, instead of allocating it. `prefs`
+// maps Pref64 of the snapshot into this table. Returns false if the entry
+// doesn't fit into this table.
+bool
+restore(const snapshot_entry &r, std::uint32_t t, const std::vector<std::uint32_t> &prefs)
+{
+    if (r.pref >= prefs.size() || prefs[r.pref] == pref64_none) { return false; }
+
+    const auto e = designated((nat_entry)) by
+    (
+      ((.v4add  = r.v4add))
+      ((.v6add  = r.v6add))
+      ((.v4port = r.v4port))
+      ((.v6port = r.v6port))
+      ((.proto  = r.proto))
+      ((.pref   = static_cast<std::uint8_t>(prefs[r.pref])))
+      ((.updated_at = t - net_to_host(r.idle)))
+    );
+    if (net_to_host(r.idle) >= lifetime(e.proto)) { return false; }
+
+    if (e.proto)
+    {
+        if (net_to_host(e.v4add.s_addr) - napt_base >= napt_size) { return false; }
+
+        auto &s = shard_of(e.v4port);
+        const auto k6 = key6(e);
+        const auto k4 = key4(e);
+        if (s.state->used == s.capacity || s.by_ep6.find(k6) || s.by_ep4.find(k4)) { return false; }
+
+        const auto index = s.emplace(e);
+        s.by_ep6.insert(k6, index + 1);
+        s.by_ep4.insert(k4, index + 1);
+        return true;
+    }
+
+    // The address should be in a pool which still serves the host. Entry is
+    // put into the shard which owns the address, and indexed by the shard of
+    // the host too if they differ.
+    const auto o = owner_of(e.v4add);
+    if (o.shard == config::table_shards || !v4pool_serves(o.pool, e.v6add)) { return false; }
+
+    auto &s = shards[o.shard];
+    auto &home = shard_of(e.v6add);
+    auto &part = s.parts[o.pool];
+    if (part.free.used(o.offset) || s.state->used == s.capacity || home.by_v6.find(e.v6add)) { return false; }
+    if (&home != &s)
+    {
+        if (home.state->lent == home.capacity) { return false; }
+        home.by_v6.insert(e.v6add, lent_to(s.id));
+        ++home.state->lent;
+    }
+
+    const auto index = s.emplace(e);
+    s.by_v6.insert(e.v6add, index + 1);
+    s.find_v4(o) = index + 1;
+    part.free.take(o.offset);
+    part.bound->fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Called under the lock of `s`.
+binding_stamp
+stamp_of(const shard &s, std::uint32_t index) noexcept
+{
+    return {s.id, index, s.generation[index].load(std::memory_order_relaxed), s.updated[index]};
 }
 
 } // namespace shinano::<anonymous-namespace>
 
-const in_addr &
+in_addr
+lookup(const in6_addr &address, std::uint32_t pref, binding_stamp &stamp)
+{
+    auto use = [&](shard &s, std::uint32_t i)
+    {
+        s.touch(i, pref);
+        stamp = stamp_of(s, i);
+        return s.v4add[i];
+    };
+
+    auto &home = shard_of(address);
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(home.mutex);
+
+        const auto p = home.by_v6.find(address);
+        if (!p) { return allocate_v4address(home, address, use); }
+        if (*p < lent_base) { return use(home, *p - 1); }
+
+        // Bound by other shard, which is locked alone so that no two locks
+        // are waited at once. The binding may expire meanwhile, then the host
+        // is looked up again.
+        auto &s = shards[*p - lent_base];
+        lock.unlock();
+
+        std::lock_guard<std::mutex> other(s.mutex);
+        if (const auto q = s.by_v6.find(address)) { return use(s, *q - 1); }
+    }
+}
+
+in_addr
 lookup(const in6_addr &address)
 {
-    auto i = boost::find_if(table, [&](const nat_entry &e)
+    binding_stamp stamp;
+    return lookup(address, pref64_none, stamp);
+}
+
+in6_addr
+lookup(const in_addr &address, std::uint32_t &pref, binding_stamp &stamp)
+{
+    const auto o = owner_of(address);
+    if (o.shard == config::table_shards)
     {
-        return IN6_ARE_ADDR_EQUAL(&address, &e.v6add);
-    });
+        auto ex = translate_error("translate v4 to v6 failed: no such NAT entry");
+        detail::throw_exception(ex);
+    }
+
+    auto &s = shards[o.shard];
+    std::lock_guard<std::mutex> lock(s.mutex);
 
-    if (i == table.end())
+    const auto i = s.find_v4(o);
+    if (i == 0)
     {
-        reclaim();
-        i = allocate_v4address();
-        i->v6add = address;
+        auto ex = translate_error("translate v4 to v6 failed: no such NAT entry");
+        detail::throw_exception(ex);
     }
 
-    i->updated_at = clock::now();
-    return i->v4add;
+    s.touch(i - 1, pref64_none);
+    pref  = s.pref[i - 1];
+    stamp = stamp_of(s, i - 1);
+    return s.v6add[i - 1];
 }
 
-const in6_addr &
+in6_addr
 lookup(const in_addr &address)
 {
-    auto i = boost::find_if(table, [&](const nat_entry &e)
+    std::uint32_t pref;
+    binding_stamp stamp;
+    return lookup(address, pref, stamp);
+}
+
+bool
+fresh(const binding_stamp &stamp) noexcept
+{
+    return shards[stamp.shard].generation[stamp.index].load(std::memory_order_relaxed) == stamp.generation
+        && now.load(std::memory_order_relaxed) - stamp.time < config::flow_cache_lifetime.count();
+}
+
+std::vector<std::uint32_t>
+table_occupancy()
+{
+    std::vector<std::uint32_t> bound(geometry.size());
+    for (const auto &s : shards)
     {
-        return address.s_addr == e.v4add.s_addr;
-    });
+        for (std::size_t p = 0; p < s.parts.size(); ++p) { bound[p] += s.parts[p].bound->load(std::memory_order_relaxed); }
+    }
+    return bound;
+}
+
+endpoint4
+lookup(const endpoint6 &source, iana::protocol_number proto, std::uint32_t pref, bool bind)
+{
+    auto &s = shard_of(source.port);
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    const auto k = designated((napt_key6)) by
+    (
+      ((.addr  = source.addr))
+      ((.port  = source.port))
+      ((.proto = static_cast<std::uint8_t>(proto)))
+    );
 
-    if (i == table.end())
+    std::uint32_t i;
+    if (auto p = s.by_ep6.find(k))
     {
-        auto ex = translate_error("translate v4 to v6 failed: no such NAT entry");
+        i = *p - 1;
+    }
+    else if (bind)
+    {
+        i = s.allocate_endpoint(k);
+    }
+    else
+    {
+        auto ex = translate_error("translate v6 to v4 failed: no such NAPT binding");
+        detail::throw_exception(ex);
+    }
+
+    s.touch(i, pref);
+    return {s.v4add[i], s.ports[i].v4};
+}
+
+endpoint6
+lookup(const endpoint4 &dest, iana::protocol_number proto, std::uint32_t &pref)
+{
+    auto &s = shard_of(dest.port);
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    const auto k = designated((napt_key4)) by
+    (
+      ((.addr  = dest.addr))
+      ((.port  = dest.port))
+      ((.proto = static_cast<std::uint8_t>(proto)))
+    );
+
+    const auto i = s.by_ep4.find(k);
+    if (!i)
+    {
+        auto ex = translate_error("translate v4 to v6 failed: no such NAPT binding");
         detail::throw_exception(ex);
     }
 
-    i->updated_at = clock::now();
-    return i->v6add;
+    s.touch(*i - 1, pref64_none);
+    pref = s.pref[*i - 1];
+    return {s.v6add[*i - 1], s.ports[*i - 1].v6};
+}
+
+void
+napt_init(const in_addr &pool, std::size_t plen)
+{
+    BOOST_ASSERT(plen <= 32);
+
+    napt      = true;
+    napt_size = plen == 0 ? 0xffffffffu : (std::uint32_t(1) << (32 - plen));
+    napt_base = net_to_host(pool.s_addr) & ~(napt_size - 1);
 }
 
+bool
+napt_enabled() noexcept
+{
+    return napt;
+}
 
 void
-temporary_table_init()
+table_tick()
 {
-    using interval = decltype(free_list)::interval_type;
+    const auto t = coarse_seconds();
+    now.store(t, std::memory_order_relaxed);
 
-    in_addr begin, end;
-    if (inet_aton("100.64.0.0", &begin) < 0
-     || inet_aton("100.127.255.255", &end) < 0)
+    std::size_t budget = config::table_expire_budget;
+    for (auto &s : shards)
     {
-        throw_with_errno();
+        // Nothing is due in the middle of a tick, unless the last one ran out
+        // of the budget; it is checked again under the lock. Busy shard is
+        // left for next batch, rather than waiting for other worker.
+        if (s.state->cursor > t / width) { continue; }
+
+        std::unique_lock<std::mutex> lock(s.mutex, std::try_to_lock);
+        if (!lock) { continue; }
+
+        s.advance(t, budget);
+        if (budget == 0) { return; }
     }
+}
+
+std::size_t
+table_save(const char *path)
+{
+    const auto temp = std::string(path) + ".tmp";
+    detail::safe_desc fd(::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+
+    auto h = designated((snapshot_header)) by
+    (
+      ((.version   = host_to_net(snapshot_version)))
+      ((.napt_size = host_to_net(napt ? napt_size : 0)))
+      ((.napt_base = host_to_net(napt_base)))
+    );
+    std::copy(std::begin(snapshot_magic), std::end(snapshot_magic), std::begin(h.magic));
+    const std::uint64_t keys[] = { header->sharding.k0, header->sharding.k1, header->pairing.k0, header->pairing.k1 };
+    std::transform(std::begin(keys), std::end(keys), std::begin(h.keys), host_to_net<std::uint64_t>);
+
+    snapshot_stream out {fd.native(), 0};
+    out.put(&h, sizeof(h));
 
-    auto isa = interval::open(net_to_host(begin.s_addr), net_to_host(end.s_addr));
-    free_list += isa;
+    const auto records = prefix_records();
+    const auto nrecords = host_to_net<std::uint32_t>(records.size());
+    const auto lead = reinterpret_cast<const std::uint8_t *>(&nrecords);
+    const auto body = reinterpret_cast<const std::uint8_t *>(records.data());
+    std::vector<std::uint8_t> list(lead, lead + sizeof(nrecords));
+    list.insert(list.end(), body, body + records.size() * sizeof(prefix_record));
+    out.put(list.data(), list.size());
 
-    prefix_len = 96;
-    if (inet_pton(AF_INET6, "64:ff9b::", &prefix) != 1)
+    // Copy live entries under the lock, and write them after releasing it.
+    std::size_t count = 0;
+    std::vector<snapshot_entry> entries;
+    std::vector<std::uint8_t> block(sizeof(std::uint32_t) + snapshot_block * sizeof(snapshot_entry));
+    for (auto &s : shards)
     {
-        throw_with_errno();
+        entries.clear();
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+
+            const auto t = now.load(std::memory_order_relaxed);
+            entries.reserve(s.state->used);
+            for (std::uint32_t i = 0; i < s.state->used; ++i)
+            {
+                if (s.v4add[i].s_addr) { entries.push_back(to_snapshot(s.entry(i), t)); }
+            }
+        }
+
+        for (std::size_t i = 0; i < entries.size(); i += snapshot_block)
+        {
+            const std::uint32_t n = std::min(snapshot_block, entries.size() - i);
+            const auto c = host_to_net(n);
+            std::memcpy(block.data(), &c, sizeof(c));
+            std::memcpy(block.data() + sizeof(c), &entries[i], n * sizeof(snapshot_entry));
+            out.put(block.data(), sizeof(c) + n * sizeof(snapshot_entry));
+        }
+        count += entries.size();
     }
+
+    const std::uint32_t end = 0;
+    out.put(&end, sizeof(end));
+    if (::fsync(fd.native()) < 0 || ::rename(temp.c_str(), path) < 0) { throw_with_errno(); }
+    sync_directory(path);
+    return count;
 }
 
-const in6_addr &
-temporary_prefix() noexcept
+restore_stats
+table_restore(const char *path)
 {
-    return prefix;
+    detail::safe_desc fd(::open(path, O_RDONLY | O_CLOEXEC));
+    snapshot_stream in {fd.native(), 0};
+
+    snapshot_header h;
+    read_all(fd.native(), &h, sizeof(h));
+    in.check(&h, sizeof(h));
+    if (!std::equal(std::begin(snapshot_magic), std::end(snapshot_magic), std::begin(h.magic))
+     || net_to_host(h.version) != snapshot_version)
+    {
+        detail::throw_exception(std::runtime_error("snapshot is of unknown format"));
+    }
+    if ((net_to_host(h.napt_size) != 0) != napt)
+    {
+        detail::throw_exception(std::runtime_error("snapshot is of other mode"));
+    }
+
+    // Keep the keys, so that entries are found in same shard, and hosts take
+    // same NAPT address as before. The table is empty yet.
+    std::uint64_t keys[4];
+    std::transform(std::begin(h.keys), std::end(h.keys), std::begin(keys), net_to_host<std::uint64_t>);
+    header->sharding = detail::siphash{keys[0], keys[1]};
+    header->pairing  = detail::siphash{keys[2], keys[3]};
+
+    // Entries through Pref64 which is no longer configured are skipped.
+    std::uint32_t nrecords;
+    std::vector<std::uint8_t> list(sizeof(nrecords));
+    read_all(fd.native(), list.data(), sizeof(nrecords));
+    std::memcpy(&nrecords, list.data(), sizeof(nrecords));
+    nrecords = net_to_host(nrecords);
+    if (nrecords > config::max_pref64) { detail::throw_exception(std::runtime_error("snapshot is corrupted")); }
+
+    list.resize(sizeof(nrecords) + nrecords * sizeof(prefix_record));
+    read_all(fd.native(), list.data() + sizeof(nrecords), nrecords * sizeof(prefix_record));
+    in.check(list.data(), list.size());
+
+    const auto current = prefix_records();
+    std::vector<std::uint32_t> prefs(nrecords, pref64_none);
+    for (std::uint32_t i = 0; i < nrecords; ++i)
+    {
+        prefix_record r;
+        std::memcpy(&r, list.data() + sizeof(nrecords) + i * sizeof(r), sizeof(r));
+        for (std::uint32_t j = 0; j < current.size(); ++j)
+        {
+            if (std::memcmp(&r.prefix, &current[j].prefix, sizeof(r.prefix)) == 0 && r.plen == current[j].plen) { prefs[i] = j; }
+        }
+    }
+
+    restore_stats stats {0, 0};
+    const auto t = now.load(std::memory_order_relaxed);
+    std::vector<std::uint8_t> block(sizeof(std::uint32_t) + snapshot_block * sizeof(snapshot_entry));
+    for (;;)
+    {
+        // Count is verified with entries, after checked not to overrun.
+        std::uint32_t n;
+        read_all(fd.native(), block.data(), sizeof(n));
+        std::memcpy(&n, block.data(), sizeof(n));
+        n = net_to_host(n);
+        if (n > snapshot_block) { detail::throw_exception(std::runtime_error("snapshot is corrupted")); }
+
+        read_all(fd.native(), block.data() + sizeof(n), n * sizeof(snapshot_entry));
+        in.check(block.data(), sizeof(n) + n * sizeof(snapshot_entry));
+        if (n == 0)
+        {
+            if (!read_end(fd.native())) { detail::throw_exception(std::runtime_error("snapshot is corrupted")); }
+            return stats;
+        }
+
+        snapshot_entry r;
+        for (std::uint32_t i = 0; i < n; ++i)
+        {
+            std::memcpy(&r, block.data() + sizeof(n) + i * sizeof(r), sizeof(r));
+            if (restore(r, t, prefs)) { ++stats.restored; }
+            else { ++stats.skipped; }
+        }
+    }
 }
 
-std::size_t
-temporary_plen() noexcept
+
+bool
+temporary_table_init(const char *segment_name, bool discard)
 {
-    return prefix_len;
+    // Split each pool into contiguous parts, which are laid out one after
+    // another in every shard.
+    geometry.clear();
+    v4_slots  = 0;
+    free_size = 0;
+    std::vector<std::uint32_t> pools; // base and length of each pool
+    for (const auto &p : napt ? std::vector<v4pool>() : v4pool_all())
+    {
+        const std::uint32_t size = std::uint32_t(1) << (32 - p.plen);
+        const std::uint32_t part = (size + config::table_shards - 1) / config::table_shards;
+        geometry.push_back(pool_geometry{net_to_host(p.prefix.s_addr), size, part, v4_slots, free_size});
+        v4_slots  += part;
+        free_size += detail::bitmap_pool::footprint(part);
+        pools.push_back(p.prefix.s_addr);
+        pools.push_back(p.plen);
+    }
+
+    // Stateless shard never holds more entries than its addresses.
+    const std::uint32_t capacity = napt ? config::napt_max_bindings / config::table_shards : v4_slots;
+    BOOST_ASSERT(napt || capacity < lent_base);
+    const auto l = layout_of(capacity);
+    const auto first = round_up(sizeof(table_header), cache_line);
+
+    auto want = designated((table_header)) by
+    (
+      ((.length      = first + config::table_shards * l.size))
+      ((.version     = layout_version))
+      ((.shards      = config::table_shards))
+      ((.wheel_slots = config::table_wheel_slots))
+      ((.capacity    = capacity))
+      ((.napt_base   = napt_base))
+      ((.napt_size   = napt_size))
+      ((.pools       = detail::siphash{0, 0}(pools.data(), pools.size() * sizeof(std::uint32_t))))
+      ((.prefixes    = prefix_digest()))
+    );
+    std::copy(std::begin(layout_magic), std::end(layout_magic), std::begin(want.magic));
+
+    bool fresh = discard;
+    map_table(segment_name, want, fresh);
+    if (fresh)
+    {
+        timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+        want.epoch    = ts.tv_sec;
+        want.sharding = detail::siphash::make();
+        want.pairing  = detail::siphash::make();
+        *header = want;
+    }
+    now = coarse_seconds();
+
+    auto area = static_cast<std::uint8_t *>(segment.get()) + first;
+    for (std::size_t i = 0; i < config::table_shards; ++i, area += l.size)
+    {
+        shards[i].id = i;
+        shards[i].attach(area, l, capacity, fresh);
+    }
+    return !fresh;
 }
 
 } // namespace shinano
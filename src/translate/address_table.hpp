@@ -6,16 +6,108 @@
 #ifndef shinano_translate_address_table_hpp_
 #define shinano_translate_address_table_hpp_
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 #include <netinet/in.h>
 
+#include "config.hpp"
+#include "translate/pref64.hpp"
+#include "translate/v4pool.hpp"
+
 namespace shinano {
 
-const in_addr &
+// Lookups may be called from any translation worker concurrently, then return
+// a copy of the mapped address instead of the reference into the table.
+in_addr
 lookup(const in6_addr &address);
 
-const in6_addr &
+in6_addr
 lookup(const in_addr &address);
 
+// Handle of a stateless binding, which tells whether the binding may have
+// changed since the lookup.
+struct binding_stamp
+{
+    std::uint32_t shard;
+    std::uint32_t index;      // of the slot in the shard
+    std::uint32_t generation; // of the slot, bumped whenever the binding expires
+    std::uint32_t time;       // of the lookup, in coarse seconds
+};
+
+// `pref` is index of Pref64 through which the v6 host reaches v4, which is
+// kept in the binding by v6 to v4 lookups, so that replies are translated
+// through same prefix. The lookups above leave it untouched.
+in_addr
+lookup(const in6_addr &address, std::uint32_t pref, binding_stamp &stamp);
+
+in6_addr
+lookup(const in_addr &address, std::uint32_t &pref, binding_stamp &stamp);
+
+// Whether the binding is unchanged, and was looked up within
+// config::flow_cache_lifetime; the lookup also keeps the binding alive.
+bool
+fresh(const binding_stamp &stamp) noexcept;
+
+// Addresses bound in each pool of v4pool_all(), which shards count on their
+// own and are summed up without locks. Empty with NAPT.
+std::vector<std::uint32_t>
+table_occupancy();
+
+// Transport endpoint. For ICMP query messages, port is the identifier.
+// Port is in network order.
+struct endpoint4
+{
+    in_addr       addr;
+    std::uint16_t port;
+};
+
+struct endpoint6
+{
+    in6_addr      addr;
+    std::uint16_t port;
+};
+
+// Stateful NAPT (RFC 6146) instead of mapping whole addresses, so that many
+// v6 hosts share each address of the pool. Bindings are endpoint-independent
+// mappings for TCP, UDP and ICMP query, i.e. `proto` is either of them.
+void
+napt_init(const in_addr &pool, std::size_t plen);
+
+bool
+napt_enabled() noexcept;
+
+// Bind the endpoint of v6 host if `bind` and not bound yet. `pref` is kept
+// in the binding as above unless pref64_none.
+endpoint4
+lookup(const endpoint6 &source, iana::protocol_number proto, std::uint32_t pref, bool bind = true);
+
+endpoint6
+lookup(const endpoint4 &dest, iana::protocol_number proto, std::uint32_t &pref);
+
+// Update the clock of the table, and expire entries idle for
+// config::table_expires_after. Each worker should call this once per batch of
+// packets; it is cheap unless some entries are due, and expires at most
+// config::table_expire_budget entries at once.
+void
+table_tick();
+
+// Write live entries into a snapshot at `path`, which is replaced at once, and
+// returns the number of them. Each shard is locked only while it is copied.
+std::size_t
+table_save(const char *path);
+
+struct restore_stats
+{
+    std::size_t restored;
+    std::size_t skipped; // expired, out of the pools, or conflicting
+};
+
+// Load a snapshot written by table_save into empty table, which is initialised
+// with `discard` before. Throws if the snapshot is corrupted or of other mode.
+restore_stats
+table_restore(const char *path);
+
 } // namespace shinano
 
 #endif
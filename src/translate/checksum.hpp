@@ -8,6 +8,7 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <type_traits>
 
 #include <sys/uio.h>
 
@@ -107,6 +108,40 @@ i_ccs(const V (&v)[N]) noexcept
     return aux::_i_ccs(v, mpl::make_index_tuple<N, M>());
 }
 
+// Checksum field `sum` updated for data whose ccs `from` is replaced with
+// data of ccs `to`, without summing up the rest again.
+// see: RFC1624 http://tools.ietf.org/html/rfc1624
+inline std::uint16_t
+adjust(std::uint16_t sum, std::uint16_t from, std::uint16_t to) noexcept
+{
+    const std::uint16_t a = aux::reducer(static_cast<std::uint16_t>(~sum), static_cast<std::uint16_t>(~from));
+    return ~aux::reducer(a, to);
+}
+
+// Adjust checksum field of `Tag` header at `l4`, unless the field is cut off
+// from `len` bytes. UDP without checksum is left as is.
+template <typename Tag>
+inline void
+adjust(void *l4, std::size_t len, std::uint16_t from, std::uint16_t to) noexcept
+{
+    if (len < checksum_offset<Tag>() + sizeof(std::uint16_t)) { return; }
+
+    constexpr bool udp = std::is_same<Tag, tag::udp>::value;
+    auto &sum = checksum_field<Tag>(l4);
+    if (udp && sum == 0) { return; }
+    sum = adjust(sum, from, to);
+    if (udp && sum == 0) { sum = 0xffff; }
+}
+
+// ccs of plain data, e.g. pseudo header.
+template <typename T>
+inline std::uint16_t
+ccs_of(const T &v) noexcept
+{
+    const iovec i = {const_cast<T *>(&v), sizeof(v)};
+    return ccs(i);
+}
+
 } } // namespace shinano::detail
 
 #endif // shinano_translate_checksum_hpp_
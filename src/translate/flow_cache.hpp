@@ -0,0 +1,88 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_translate_flow_cache_hpp_
+#define shinano_translate_flow_cache_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+
+#include "config.hpp"
+#include "translate/address_table.hpp"
+
+namespace shinano {
+
+// Direct mapped cache of translated headers by the address pair of original
+// packets, which is owned by single thread. A hit replaces lookups of both
+// addresses and building the header, and is valid while the stamp of the
+// binding is fresh. Colliding pairs just evict each other.
+template <typename Address, typename Header>
+struct flow_cache
+{
+    // Returns the header, or nullptr if missed.
+    const Header *
+    find(const Address &src, const Address &dst) noexcept
+    {
+        auto &e = slots[index(src, dst)];
+        if (!e.used || !equal(e.src, src) || !equal(e.dst, dst) || !fresh(e.stamp)) { return nullptr; }
+        return &e.header;
+    }
+
+    const Header &
+    insert(const Address &src, const Address &dst, const Header &header, const binding_stamp &stamp) noexcept
+    {
+        auto &e = slots[index(src, dst)];
+        e.used   = true;
+        e.src    = src;
+        e.dst    = dst;
+        e.header = header;
+        e.stamp  = stamp;
+        return e.header;
+    }
+
+private:
+    struct entry
+    {
+        Address       src;
+        Address       dst;
+        Header        header;
+        binding_stamp stamp;
+        bool          used;
+    };
+
+    static bool
+    equal(const Address &a, const Address &b) noexcept { return std::memcmp(&a, &b, sizeof(Address)) == 0; }
+
+    // Remote hosts can only make pairs collide, which costs a lookup as
+    // without the cache, then keyed hash is not needed.
+    static std::uint32_t
+    fold(const Address &a) noexcept
+    {
+        std::uint32_t h = 0;
+        for (std::size_t i = 0; i < sizeof(Address); i += 4)
+        {
+            std::uint32_t w;
+            std::memcpy(&w, reinterpret_cast<const std::uint8_t *>(&a) + i, sizeof(w));
+            h = (h ^ w) * 0x9e3779b1u;
+        }
+        return h;
+    }
+
+    static std::size_t
+    index(const Address &src, const Address &dst) noexcept
+    {
+        static_assert(sizeof(Address) % 4 == 0, "address should be folded by words");
+        const auto h = (fold(src) ^ (fold(dst) >> 7)) * 0x85ebca6bu;
+        return (h >> 16) & (config::flow_cache_slots - 1);
+    }
+
+    entry slots[config::flow_cache_slots];
+};
+
+} // namespace shinano
+
+#endif
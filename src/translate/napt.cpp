@@ -0,0 +1,221 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <cstdint>
+
+#include "config.hpp"
+#include "util.hpp"
+#include "detail/exception.hpp"
+
+#include "translate.hpp"
+#include "translate/address_table.hpp"
+#include "translate/checksum.hpp"
+#include "translate/napt.hpp"
+
+namespace shinano {
+
+namespace {
+
+// Both ports and ICMP identifier are in first 8 bytes of the header.
+constexpr std::size_t transport_prefix = 8;
+
+// Port field of either endpoint, or identifier for ICMP query. ICMP and ICMPv6
+// place the identifier at same offset.
+std::uint16_t &
+port_field(buffer_ref l4, iana::protocol_number proto, bool source)
+{
+    if (l4.size() < transport_prefix)
+    {
+        detail::throw_exception(translate_error("NAPT failed: truncated transport header"));
+    }
+
+    switch (proto)
+    {
+      case iana::protocol_number::tcp:
+        return source ? l4.data_as<tag::tcp::header>()->source : l4.data_as<tag::tcp::header>()->dest;
+
+      case iana::protocol_number::udp:
+        return source ? l4.data_as<tag::udp::header>()->source : l4.data_as<tag::udp::header>()->dest;
+
+      default:
+        return *l4.data_as<std::uint16_t>(4);
+    }
+}
+
+// Rewrite port field of a packet quoted by ICMP error message, and adjust its
+// checksum as far as it is quoted, so that the packet still matches what the
+// host sent or received.
+void
+rewrite_quoted(buffer_ref l4, iana::protocol_number proto, std::uint16_t &port, std::uint16_t to)
+{
+    switch (proto)
+    {
+      case iana::protocol_number::tcp:
+        detail::adjust<tag::tcp>(l4.data(), l4.size(), port, to);
+        break;
+
+      case iana::protocol_number::udp:
+        detail::adjust<tag::udp>(l4.data(), l4.size(), port, to);
+        break;
+
+      default:
+        // ICMPv6 places the checksum at same offset.
+        detail::adjust<tag::icmp>(l4.data(), l4.size(), port, to);
+        break;
+    }
+    port = to;
+}
+
+// Protocol of NAPT binding, where ICMP query of both versions is icmp.
+iana::protocol_number
+binding_protocol(const ipv6::header &ip6, buffer_ref l4)
+{
+    switch (payload_protocol(ip6))
+    {
+      case iana::protocol_number::tcp:
+      case iana::protocol_number::udp:
+        return payload_protocol(ip6);
+
+      case iana::protocol_number::icmp6:
+        switch (static_cast<iana::icmp6::type>(l4.data_as<ipv6::icmp6_header>()->icmp6_type))
+        {
+          case iana::icmp6::type::echo_request:
+          case iana::icmp6::type::echo_reply:
+            return iana::protocol_number::icmp;
+
+          default:
+            break;
+        }
+        // fall through
+
+      default:
+        translate_break("silently dropped: no NAPT binding for the message");
+    }
+}
+
+iana::protocol_number
+binding_protocol(const ipv4::header &ip, buffer_ref l4)
+{
+    switch (payload_protocol(ip))
+    {
+      case iana::protocol_number::tcp:
+      case iana::protocol_number::udp:
+        return payload_protocol(ip);
+
+      case iana::protocol_number::icmp:
+        switch (static_cast<iana::icmp::type>(l4.data_as<ipv4::icmp_header>()->type))
+        {
+          case iana::icmp::type::echo_request:
+          case iana::icmp::type::echo_reply:
+            return iana::protocol_number::icmp;
+
+          default:
+            break;
+        }
+        // fall through
+
+      default:
+        translate_break("silently dropped: no NAPT binding for the message");
+    }
+}
+
+bool
+is_error(const ipv6::header &ip6, buffer_ref l4) noexcept
+{
+    if (payload_protocol(ip6) != iana::protocol_number::icmp6) { return false; }
+    // Error messages have type below 128.
+    return l4.data_as<ipv6::icmp6_header>()->icmp6_type < 128;
+}
+
+bool
+is_error(const ipv4::header &ip, buffer_ref l4) noexcept
+{
+    if (payload_protocol(ip) != iana::protocol_number::icmp) { return false; }
+    switch (static_cast<iana::icmp::type>(l4.data_as<ipv4::icmp_header>()->type))
+    {
+      case iana::icmp::type::destination_unreachable:
+      case iana::icmp::type::time_exceeded:
+      case iana::icmp::type::parameter_problem:
+        return true;
+
+      default:
+        return false;
+    }
+}
+
+} // namespace shinano::<anonymous-namespace>
+
+in_addr
+napt_outbound(buffer_ref b, std::uint32_t pref)
+{
+    auto &ip6 = *b.data_as<ipv6::header>();
+    auto l4   = b.next_to<ipv6::header>();
+    if (l4.size() < transport_prefix)
+    {
+        detail::throw_exception(translate_error("NAPT failed: truncated transport header"));
+    }
+
+    if (!is_error(ip6, l4))
+    {
+        const auto proto = binding_protocol(ip6, l4);
+        auto &port = port_field(l4, proto, true);
+        const auto ep = lookup(endpoint6{source(ip6), port}, proto, pref);
+        port = ep.port;
+        return ep.addr;
+    }
+
+    // The body is a packet which the v6 host received, then its destination
+    // is the bound endpoint.
+    auto body = l4.next_to<ipv6::icmp6_header>();
+    if (body.size() < sizeof(ipv6::header) + transport_prefix)
+    {
+        detail::throw_exception(translate_error("NAPT failed: truncated ICMPv6 error message"));
+    }
+    auto &iip6 = *body.data_as<ipv6::header>();
+    auto il4   = body.next_to<ipv6::header>();
+    const auto proto = binding_protocol(iip6, il4);
+    auto &port = port_field(il4, proto, false);
+    const auto ep = lookup(endpoint6{dest(iip6), port}, proto, pref64_none, false);
+    rewrite_quoted(il4, proto, port, ep.port);
+    return ep.addr;
+}
+
+in6_addr
+napt_inbound(buffer_ref b, std::uint32_t &pref)
+{
+    auto &ip = *b.data_as<ipv4::header>();
+    auto l4  = b.next_to<ipv4::header>();
+    if (l4.size() < transport_prefix)
+    {
+        detail::throw_exception(translate_error("NAPT failed: truncated transport header"));
+    }
+
+    if (!is_error(ip, l4))
+    {
+        const auto proto = binding_protocol(ip, l4);
+        auto &port = port_field(l4, proto, false);
+        const auto ep = lookup(endpoint4{dest(ip), port}, proto, pref);
+        port = ep.port;
+        return ep.addr;
+    }
+
+    // The body is a packet which the v6 host sent through the translator,
+    // then its source is the bound endpoint.
+    auto body = l4.next_to<ipv4::icmp_header>();
+    if (body.size() < sizeof(ipv4::header)
+     || body.size() < length(*body.data_as<ipv4::header>()) + transport_prefix)
+    {
+        detail::throw_exception(translate_error("NAPT failed: truncated ICMP error message"));
+    }
+    auto &iip = *body.data_as<ipv4::header>();
+    auto il4  = body.next_to<ipv4::header>();
+    const auto proto = binding_protocol(iip, il4);
+    auto &port = port_field(il4, proto, true);
+    const auto ep = lookup(endpoint4{source(iip), port}, proto, pref);
+    rewrite_quoted(il4, proto, port, ep.port);
+    return ep.addr;
+}
+
+} // namespace shinano
@@ -0,0 +1,33 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_translate_napt_hpp_
+#define shinano_translate_napt_hpp_
+
+#include <cstdint>
+#include <netinet/in.h>
+
+#include "translate.hpp"
+
+namespace shinano {
+
+// Stateful NAPT on packets. Port of the v6 host, or ICMP identifier, is
+// rewritten in place, then the packet is translated as stateless one with the
+// returned address. For ICMP error messages, the binding is found by the
+// packet in the body, whose endpoint is rewritten instead.
+
+// v6 to v4, where `b` starts at IPv6 header, and the destination is under
+// `pref`-th Pref64. Returns source v4 address.
+in_addr
+napt_outbound(buffer_ref b, std::uint32_t pref);
+
+// v4 to v6, where `b` starts at IPv4 header. Returns destination v6 address,
+// and `pref` is set to Pref64 which the host reaches v4 through.
+in6_addr
+napt_inbound(buffer_ref b, std::uint32_t &pref);
+
+} // namespace shinano
+
+#endif
@@ -0,0 +1,94 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "config.hpp"
+#include "util.hpp"
+#include "detail/exception.hpp"
+#include "detail/prefix_map.hpp"
+#include "translate/pref64.hpp"
+
+namespace shinano {
+
+namespace {
+
+constexpr std::size_t valid_lengths[] = { 32, 40, 48, 56, 64, 96 };
+
+std::vector<pref64> prefixes;
+detail::prefix_map  matcher;
+
+static_assert(pref64_none == detail::prefix_map::npos, "unmatched address should be none");
+
+void
+malformed(const pref64 &p, const char *why)
+{
+    detail::throw_exception(std::runtime_error(
+        "Pref64 " + to_string(p.prefix) + "/" + std::to_string(p.plen) + " " + why));
+}
+
+} // namespace shinano::<anonymous-namespace>
+
+void
+pref64_init(std::vector<pref64> list)
+{
+    if (list.empty())
+    {
+        pref64 p = {};
+        p.plen = 96;
+        if (::inet_pton(AF_INET6, "64:ff9b::", &p.prefix) != 1) { throw_with_errno(); }
+        list.push_back(p);
+    }
+    if (list.size() > config::max_pref64)
+    {
+        detail::throw_exception(std::runtime_error("too many Pref64 prefixes"));
+    }
+
+    // There are at most 6 lengths, then a match costs few probes.
+    detail::prefix_map m(list.size());
+    for (std::uint32_t i = 0; i < list.size(); ++i)
+    {
+        const auto &p = list[i];
+        if (std::find(std::begin(valid_lengths), std::end(valid_lengths), p.plen) == std::end(valid_lengths))
+        {
+            malformed(p, "should be /32, /40, /48, /56, /64 or /96");
+        }
+
+        // Bits 64 to 71 are reserved by RFC 6052, as well as ones after the prefix.
+        if (!detail::prefix_map::masked(p.prefix, p.plen) || p.prefix.s6_addr[8] != 0)
+        {
+            malformed(p, "has bits set after the prefix or in bits 64 to 71");
+        }
+        if (!m.insert(p.prefix, p.plen, i)) { malformed(p, "is given twice"); }
+    }
+
+    matcher  = std::move(m);
+    prefixes = std::move(list);
+}
+
+std::uint32_t
+pref64_match(const in6_addr &address) noexcept
+{
+    return matcher.find(address);
+}
+
+const pref64 &
+pref64_at(std::uint32_t index) noexcept
+{
+    return prefixes[index];
+}
+
+const std::vector<pref64> &
+pref64_all() noexcept
+{
+    return prefixes;
+}
+
+} // namespace shinano
@@ -0,0 +1,45 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_translate_pref64_hpp_
+#define shinano_translate_pref64_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+
+namespace shinano {
+
+// Pref64::/n (RFC 6052), whose length is either of 32, 40, 48, 56, 64 or 96.
+struct pref64
+{
+    in6_addr    prefix;
+    std::size_t plen;
+};
+
+// Configure prefixes, each of which is identified by its index afterward. The
+// well-known prefix 64:ff9b::/96 is used if `prefixes` is empty. Throws if
+// any prefix is malformed or duplicated. Should be called before any other
+// function of this header and the NAT table.
+void
+pref64_init(std::vector<pref64> prefixes);
+
+constexpr std::uint32_t pref64_none = 0xffffffffu;
+
+// Index of the longest prefix which covers `address`, or pref64_none. The
+// table is never changed after pref64_init, then lock free.
+std::uint32_t
+pref64_match(const in6_addr &address) noexcept;
+
+const pref64 &
+pref64_at(std::uint32_t index) noexcept;
+
+const std::vector<pref64> &
+pref64_all() noexcept;
+
+} // namespace shinano
+
+#endif
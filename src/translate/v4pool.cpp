@@ -0,0 +1,191 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "config.hpp"
+#include "util.hpp"
+#include "detail/exception.hpp"
+#include "detail/prefix_map.hpp"
+#include "translate/v4pool.hpp"
+
+namespace shinano {
+
+namespace {
+
+// Pools serving same hosts. `by_weight` holds positions in `pools`, each of
+// which is repeated by its weight, so that a hash picks one by single load.
+struct group
+{
+    std::vector<std::uint32_t> pools;
+    std::vector<std::uint32_t> by_weight;
+};
+
+struct range
+{
+    std::uint32_t base; // in host order
+    std::uint32_t last;
+    std::uint32_t index;
+};
+
+std::vector<v4pool>        pools;
+std::vector<std::uint32_t> group_of; // by pool
+std::vector<group>         groups;
+std::uint32_t              shared;    // group of hosts out of any customer, or v4pool_none
+detail::prefix_map         customers; // to group
+std::vector<range>         ranges;    // sorted by address
+
+static_assert(v4pool_none == detail::prefix_map::npos, "group of unknown customer should be none");
+
+std::uint32_t
+gcd(std::uint32_t a, std::uint32_t b) noexcept
+{
+    while (b) { a %= b; std::swap(a, b); }
+    return a;
+}
+
+void
+malformed(const v4pool &p, const std::string &why)
+{
+    detail::throw_exception(std::runtime_error(
+        "v4 pool " + to_string(p.prefix) + "/" + std::to_string(p.plen) + " " + why));
+}
+
+} // namespace shinano::<anonymous-namespace>
+
+void
+v4pool_init(std::vector<v4pool> list)
+{
+    if (list.empty())
+    {
+        v4pool p = {};
+        p.plen   = 10;
+        p.weight = 1;
+        if (::inet_pton(AF_INET, "100.64.0.0", &p.prefix) != 1) { throw_with_errno(); }
+        list.push_back(p);
+    }
+    if (list.size() > config::max_v4pools)
+    {
+        detail::throw_exception(std::runtime_error("too many v4 pools"));
+    }
+
+    std::vector<range> r;
+    std::vector<group> g;
+    std::vector<std::uint32_t> owner(list.size());
+    std::vector<std::uint32_t> leader; // first pool of each group, which tells its customer
+    std::uint32_t s = v4pool_none;
+    detail::prefix_map m(list.size());
+    for (std::uint32_t i = 0; i < list.size(); ++i)
+    {
+        const auto &p = list[i];
+        // The first and last addresses are never bound.
+        if (p.plen == 0 || 30 < p.plen) { malformed(p, "should be /1 to /30"); }
+
+        const auto size = std::uint32_t(1) << (32 - p.plen);
+        const auto base = net_to_host(p.prefix.s_addr);
+        if (base & (size - 1)) { malformed(p, "has bits set after the prefix"); }
+        if (p.weight == 0 || config::max_v4pool_weight < p.weight)
+        {
+            malformed(p, "should be weighted 1 to " + std::to_string(config::max_v4pool_weight));
+        }
+        if (128 < p.customer_plen || !detail::prefix_map::masked(p.customer, p.customer_plen))
+        {
+            malformed(p, "has bits set after the customer prefix");
+        }
+        r.push_back(range{base, base + size - 1, i});
+
+        // Pools of same customer form a group.
+        auto same = [&](std::uint32_t j)
+        {
+            const auto &q = list[j];
+            return q.customer_plen == p.customer_plen && std::memcmp(&q.customer, &p.customer, sizeof(q.customer)) == 0;
+        };
+        auto k = static_cast<std::uint32_t>(std::find_if(leader.begin(), leader.end(), same) - leader.begin());
+        if (k == leader.size())
+        {
+            leader.push_back(i);
+            g.emplace_back();
+            if (p.customer_plen == 0) { s = k; }
+            else { m.insert(p.customer, p.customer_plen, k); }
+        }
+        owner[i] = k;
+        g[k].pools.push_back(i);
+    }
+
+    std::sort(r.begin(), r.end(), [](const range &a, const range &b) { return a.base < b.base; });
+    for (std::size_t i = 1; i < r.size(); ++i)
+    {
+        if (r[i].base <= r[i - 1].last) { malformed(list[r[i].index], "overlaps other pool"); }
+    }
+
+    // Weights are divided by their common divisor to keep the table short.
+    for (auto &x : g)
+    {
+        std::uint32_t d = 0;
+        for (auto i : x.pools) { d = gcd(d, list[i].weight); }
+        for (std::uint32_t k = 0; k < x.pools.size(); ++k)
+        {
+            x.by_weight.insert(x.by_weight.end(), list[x.pools[k]].weight / d, k);
+        }
+    }
+
+    pools     = std::move(list);
+    group_of  = std::move(owner);
+    groups    = std::move(g);
+    shared    = s;
+    customers = std::move(m);
+    ranges    = std::move(r);
+}
+
+v4pool_choice
+v4pool_select(const in6_addr &host, std::uint64_t hash) noexcept
+{
+    auto i = customers.find(host);
+    if (i == v4pool_none) { i = shared; }
+    if (i == v4pool_none) { return {nullptr, 0, 0}; }
+
+    // Upper bits of the hash are scaled into the table instead of a division.
+    const auto &g = groups[i];
+    const auto k = ((hash >> 32) * g.by_weight.size()) >> 32;
+    return {g.pools.data(), static_cast<std::uint32_t>(g.pools.size()), g.by_weight[k]};
+}
+
+bool
+v4pool_serves(std::uint32_t index, const in6_addr &host) noexcept
+{
+    auto i = customers.find(host);
+    if (i == v4pool_none) { i = shared; }
+    return i == group_of[index];
+}
+
+std::uint32_t
+v4pool_find(const in_addr &address) noexcept
+{
+    const auto a = net_to_host(address.s_addr);
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), a,
+                               [](std::uint32_t a, const range &r) { return a < r.base; });
+    if (it == ranges.begin() || (--it)->last < a) { return v4pool_none; }
+    return it->index;
+}
+
+const v4pool &
+v4pool_at(std::uint32_t index) noexcept
+{
+    return pools[index];
+}
+
+const std::vector<v4pool> &
+v4pool_all() noexcept
+{
+    return pools;
+}
+
+} // namespace shinano
@@ -0,0 +1,70 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_translate_v4pool_hpp_
+#define shinano_translate_v4pool_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+
+namespace shinano {
+
+// Pool of v4 addresses which stateless translation binds to v6 hosts. A pool
+// serves either hosts in `customer`/customer_plen alone, or the rest of hosts
+// if customer_plen is 0. Pools serving same hosts are picked by `weight`,
+// e.g. to spread hosts over uplinks.
+struct v4pool
+{
+    in_addr       prefix;
+    std::size_t   plen;
+    std::uint32_t weight;
+    in6_addr      customer;
+    std::size_t   customer_plen;
+};
+
+// Configure pools, each of which is identified by its index afterward. The
+// shared pool 100.64.0.0/10 is used if `pools` is empty. Throws if any pool is
+// malformed or overlaps others. Should be called before any other function of
+// this header and the NAT table.
+void
+v4pool_init(std::vector<v4pool> pools);
+
+constexpr std::uint32_t v4pool_none = 0xffffffffu;
+
+// Pools which a v6 host may take, in order to be tried: pools[first] is picked
+// by weight, and the rest follow cyclically. `count` is 0 if no pool serves
+// the host.
+struct v4pool_choice
+{
+    const std::uint32_t * pools;
+    std::uint32_t         count;
+    std::uint32_t         first;
+};
+
+// `hash` of the host picks the pool, so that the host takes same pool again
+// as long as it's not exhausted. Pools are never changed after v4pool_init,
+// then this and v4pool_find take no lock.
+v4pool_choice
+v4pool_select(const in6_addr &host, std::uint64_t hash) noexcept;
+
+// Whether the pool may be taken by the host.
+bool
+v4pool_serves(std::uint32_t index, const in6_addr &host) noexcept;
+
+// Index of the pool which covers `address`, or v4pool_none.
+std::uint32_t
+v4pool_find(const in_addr &address) noexcept;
+
+const v4pool &
+v4pool_at(std::uint32_t index) noexcept;
+
+const std::vector<v4pool> &
+v4pool_all() noexcept;
+
+} // namespace shinano
+
+#endif
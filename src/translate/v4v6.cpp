@@ -3,6 +3,7 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <algorithm>
 #include <iostream>
 #include <cstdint>
 
@@ -15,6 +16,9 @@
 #include "translate.hpp"
 #include "translate/address_table.hpp"
 #include "translate/checksum.hpp"
+#include "translate/flow_cache.hpp"
+#include "translate/napt.hpp"
+#include "translate/pref64.hpp"
 #include <boost/range/numeric.hpp>
 #include <boost/range/adaptor/dropped.hpp>
 
@@ -42,16 +46,34 @@ struct iov_ip6
 using boost::mpl::true_;
 using boost::mpl::false_;
 
+// Translated header except fields taken from each packet, i.e. next header,
+// hop limit and payload length.
+ipv6::header
+make_header(const in6_addr &src, const in6_addr &dst) noexcept
+{
+    return designated((ipv6::header)) by
+    (
+      ((.ip6_vfc  = (6 << 4)))
+      //((.ip6_flow = <<unspecified>>))
+      //((.ip6_plen = <<TBD>>)) // kernel doesn't calc this field unlike ipv4.
+      //((.ip6_nxt  = <<per packet>>))
+      //((.ip6_hlim = <<per packet>>))
+      ((.ip6_src  = src))
+      ((.ip6_dst  = dst))
+    );
+}
+
 template <int N, typename Inner>
 std::size_t
-core(iov_ip6 (&iov)[N], buffer_ref b, const in6_addr &src, const in6_addr &dst, Inner);
+core(iov_ip6 (&iov)[N], buffer_ref b, const ipv6::header &header,
+     virtio_net_hdr *vnet, Inner);
 
 
 template <int N>
 inline std::size_t
 dispatch_core(iov_ip6 (&iov)[N], buffer_ref b, const in6_addr &src, const in6_addr &dst, false_)
 {
-    return core(iov, b, src, dst, true_{});
+    return core(iov, b, make_header(src, dst), nullptr, true_{});
 }
 
 template <int N>
@@ -65,6 +87,8 @@ void
 temporary_show_detail(const char *from, const char *to,
                       const ipv4::header &iphdr, const in6_addr &src, const in6_addr &dst)
 {
+    if (!shinano::temporary_show_detail()) { return; }
+
     const auto payload_length = net_to_host(iphdr.ip_len) - length(iphdr);
 
     std::cout
@@ -78,9 +102,11 @@ temporary_show_detail(const char *from, const char *to,
         << std::endl;
 }
 
+// If `partial`, only pseudo header is summed up into the checksum field, and
+// the rest is left to checksum offload.
 template <typename Tag, int N>
 void
-finalize_ip6(iov_ip6 (&iov)[N]) noexcept
+finalize_ip6(iov_ip6 (&iov)[N], bool partial = false) noexcept
 {
     using boost::adaptors::dropped;
     const std::uint16_t plen = boost::accumulate(iov | dropped(1), 0,
@@ -101,6 +127,11 @@ finalize_ip6(iov_ip6 (&iov)[N]) noexcept
     iovec piov[N];
     piov[0].iov_base = const_cast<void *>(static_cast<const void *>(&ph));
     piov[0].iov_len  = sizeof(ph);
+    if (partial)
+    {
+        checksum_field<Tag>(iov[1].base) = detail::ccs(piov[0]);
+        return;
+    }
     for (int i = 1; i < N; ++i)
     {
         piov[i].iov_base = iov[i].iov_base;
@@ -110,20 +141,61 @@ finalize_ip6(iov_ip6 (&iov)[N]) noexcept
     checksum_field<Tag>(iov[1].base) = ~detail::i_ccs(piov);
 }
 
+in6_addr
+embedded_address(const in_addr &address, std::uint32_t pref)
+{
+    const auto &p = pref64_at(pref);
+    return make_embedded_address(address, p.prefix, p.plen);
+}
+
+// `outer` is translated header of the error message, whose destination is the
+// host which sent the packet in the body. Its source is embedded into Pref64
+// of the binding, which is found by the longest match as the host does.
 template <int N, typename Inner>
 inline std::size_t
-reassemble_icmp_error_body(iov_ip6 (&iov)[N], buffer_ref b, Inner)
+reassemble_icmp_error_body(iov_ip6 (&iov)[N], buffer_ref b, const ipv6::header &outer, Inner)
 {
     auto be = b.next_to<ipv4::icmp_header>();
     auto &ip = *be.data_as<ipv4::header>();
-    auto srcv6 = lookup(source(ip));
-    auto dstv6 = make_embedded_address(dest(ip), temporary_prefix(), temporary_plen());
+    const auto pref = pref64_match(outer.ip6_src);
+    if (pref == pref64_none) { detail::throw_exception(translate_error("translate v4 to v6 failed: out of any Pref64")); }
+
+    // NAPT binding is shared, then can't be found by the address alone.
+    auto srcv6 = napt_enabled() ? outer.ip6_dst : lookup(source(ip));
+    auto dstv6 = embedded_address(dest(ip), pref);
     return dispatch_core(iov, be, srcv6, dstv6, Inner{});
 }
 
+template <int N>
+void
+finalize_icmp6(iov_ip6 (&iov)[N], const ipv4::header &, const ipv4::icmp_header &, false_) noexcept
+{
+    finalize_ip6<tag::icmp6>(iov);
+}
+
+// Quoted query may be cut off, then it keeps the length which the host sent,
+// and its checksum is adjusted for the type and the pseudo header alone.
+template <int N>
+void
+finalize_icmp6(iov_ip6 (&iov)[N], const ipv4::header &ip, const ipv4::icmp_header &icmp, true_) noexcept
+{
+    iov[0].ip6.ip6_plen = host_to_net<std::uint16_t>(plength(ip));
+
+    const auto ph = designated((ipv6::pseudo_header)) by
+    (
+      ((.pip6_src  = iov[0].ip6.ip6_src))
+      ((.pip6_dst  = iov[0].ip6.ip6_dst))
+      ((.pip6_plen = host_to_net<std::uint32_t>(plength(ip))))
+      ((.pip6_nxt  = iov[0].ip6.ip6_nxt))
+    );
+    const auto sum = detail::adjust(icmp.checksum, *reinterpret_cast<const std::uint16_t *>(&icmp),
+                                    *reinterpret_cast<const std::uint16_t *>(&iov[1].icmp6));
+    iov[1].icmp6.icmp6_cksum = detail::adjust(sum, 0, detail::ccs_of(ph));
+}
+
 template <int N, typename Inner>
 std::size_t
-icmp(iov_ip6 (&iov)[N], buffer_ref b, Inner)
+icmp(iov_ip6 (&iov)[N], buffer_ref b, const ipv6::header &outer, Inner)
 {
     auto &ip   = *b.data_as<ipv4::header>();
     auto bip   = b.next_to<ipv4::header>();
@@ -142,13 +214,13 @@ icmp(iov_ip6 (&iov)[N], buffer_ref b, Inner)
       case iana::icmp_type::echo_request:
         iov[1].icmp6.icmp6_type = static_cast<std::uint8_t>(iana::icmp6_type::echo_request);
         iov[2].base             = bip.next_to<ipv4::icmp_header>().data();
-        iov[2].len              = plength(ip) - iov[1].len;
+        iov[2].len              = std::min(plength(ip), bip.size()) - iov[1].len;
         break;
 
       case iana::icmp_type::echo_reply:
         iov[1].icmp6.icmp6_type = static_cast<std::uint8_t>(iana::icmp6_type::echo_reply);
         iov[2].base             = bip.next_to<ipv4::icmp_header>().data();
-        iov[2].len              = plength(ip) - iov[1].len;
+        iov[2].len              = std::min(plength(ip), bip.size()) - iov[1].len;
         break;
 
       case iana::icmp_type::destination_unreachable:
@@ -166,30 +238,30 @@ icmp(iov_ip6 (&iov)[N], buffer_ref b, Inner)
           case iana::icmp::destination_unreachable::network_unreachable_for_tos:
           case iana::icmp::destination_unreachable::host_unreachable_for_tos:
             iov[1].icmp6.icmp6_code = static_cast<std::uint8_t>(destination_unreachable::no_route_to_destination);
-            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, Inner{});
+            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, outer, Inner{});
             break;
 
           case iana::icmp::destination_unreachable::protocol:
             iov[1].icmp6.icmp6_type = static_cast<std::uint8_t>(iana::icmp6_type::parameter_problem);
             iov[1].icmp6.icmp6_code = static_cast<std::uint8_t>(iana::icmp6::parameter_problem::header_field);
-            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, Inner{});
+            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, outer, Inner{});
             break;
 
           case iana::icmp::destination_unreachable::port:
             iov[1].icmp6.icmp6_code = static_cast<std::uint8_t>(destination_unreachable::port);
-            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, Inner{});
+            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, outer, Inner{});
             break;
 
           case iana::icmp::destination_unreachable::dont_fragment:
             iov[1].icmp6.icmp6_type = static_cast<std::uint8_t>(iana::icmp6_type::packet_too_big);
             iov[1].icmp6.icmp6_code = 0;
-            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, Inner{});
+            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, outer, Inner{});
             break;
 
           case iana::icmp::destination_unreachable::network_is_a14y_prohibited:
           case iana::icmp::destination_unreachable::host_is_a14y_prohibited:
             iov[1].icmp6.icmp6_code = static_cast<std::uint8_t>(destination_unreachable::administratively_prohibited);
-            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, Inner{});
+            count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, outer, Inner{});
             break;
 
           // NOTE: Quote from RFC6145
@@ -211,7 +283,7 @@ icmp(iov_ip6 (&iov)[N], buffer_ref b, Inner)
       case iana::icmp_type::time_exceeded:
         iov[1].icmp6.icmp6_type = static_cast<std::uint8_t>(iana::icmp6_type::time_exceeded);
         iov[1].icmp6.icmp6_code = icmp.code;
-        count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, Inner{});
+        count = count - 1 + reassemble_icmp_error_body(drop<2>(iov), bip, outer, Inner{});
         break;
 
       case iana::icmp_type::parameter_problem:
@@ -300,14 +372,14 @@ icmp(iov_ip6 (&iov)[N], buffer_ref b, Inner)
         detail::throw_exception(translate_error("unknown ICMP type"));
     }
 
-    finalize_ip6<tag::icmp6>(iov);
+    finalize_icmp6(iov, ip, icmp, Inner{});
 
     return count;
 }
 
 template <typename Tag, int N>
 std::size_t
-generic(iov_ip6 (&iov)[N], buffer_ref b)
+generic(iov_ip6 (&iov)[N], buffer_ref b, virtio_net_hdr *vnet, false_)
 {
     auto bip = b.next_to<ipv4::header>();
 
@@ -315,27 +387,62 @@ generic(iov_ip6 (&iov)[N], buffer_ref b)
     iov[1].len  = bip.size();
     checksum_field<Tag>(iov[1].base) = 0;
 
-    finalize_ip6<Tag>(iov);
+    if (vnet)
+    {
+        // Payload is never touched; the kernel or NIC completes the checksum.
+        vnet->flags       = (vnet->flags & ~VIRTIO_NET_HDR_F_DATA_VALID) | VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet->csum_start  = iov[0].len;
+        vnet->csum_offset = checksum_offset<Tag>();
+    }
+    finalize_ip6<Tag>(iov, vnet);
 
     return 2;
 }
 
-template <int N, typename Inner>
+// Quoted packet may be cut off, then it keeps the length which the host sent,
+// and its checksum is adjusted for the pseudo header alone.
+template <typename Tag, int N>
 std::size_t
-core(iov_ip6 (&iov)[N], buffer_ref b, const in6_addr &src, const in6_addr &dst, Inner)
+generic(iov_ip6 (&iov)[N], buffer_ref b, virtio_net_hdr *, true_)
 {
-    auto &ip = *b.data_as<ipv4::header>();
+    const auto &ip = *b.data_as<ipv4::header>();
+    auto bip = b.next_to<ipv4::header>();
 
-    iov[0].ip6 = designated((ipv6::header)) by
+    iov[1].base = bip.data();
+    iov[1].len  = bip.size();
+    iov[0].ip6.ip6_plen = host_to_net<std::uint16_t>(plength(ip));
+
+    const auto from = designated((ipv4::pseudo_header)) by
     (
-      ((.ip6_vfc  = (6 << 4)))
-      //((.ip6_flow = <<unspecified>>))
-      //((.ip6_plen = <<TBD>>)) // kernel doesn't calc this field unlike ipv4.
-      ((.ip6_nxt  = ip.ip_p))
-      ((.ip6_hlim = ip.ip_ttl))
-      ((.ip6_src  = src))
-      ((.ip6_dst  = dst))
+      ((.pip_src   = ip.ip_src))
+      ((.pip_dst   = ip.ip_dst))
+      ((.pip_proto = ip.ip_p))
+      ((.pip_len   = host_to_net<std::uint16_t>(plength(ip))))
     );
+    const auto to = designated((ipv6::pseudo_header)) by
+    (
+      ((.pip6_src  = iov[0].ip6.ip6_src))
+      ((.pip6_dst  = iov[0].ip6.ip6_dst))
+      ((.pip6_plen = host_to_net<std::uint32_t>(plength(ip))))
+      ((.pip6_nxt  = iov[0].ip6.ip6_nxt))
+    );
+    detail::adjust<Tag>(iov[1].base, iov[1].len, detail::ccs_of(from), detail::ccs_of(to));
+
+    return 2;
+}
+
+template <int N, typename Inner>
+std::size_t
+core(iov_ip6 (&iov)[N], buffer_ref b, const ipv6::header &header,
+     virtio_net_hdr *vnet, Inner)
+{
+    auto &ip = *b.data_as<ipv4::header>();
+    const auto &src = header.ip6_src;
+    const auto &dst = header.ip6_dst;
+
+    iov[0].ip6 = header;
+    iov[0].ip6.ip6_nxt  = ip.ip_p;
+    iov[0].ip6.ip6_hlim = ip.ip_ttl;
     iov[0].len = length(iov[0].ip6);
 
     std::size_t ret = 0;
@@ -344,17 +451,19 @@ core(iov_ip6 (&iov)[N], buffer_ref b, const in6_addr &src, const in6_addr &dst,
       case iana::protocol_number::icmp:
         // Adjust next-header field for ICMPv6
         iov[0].ip6.ip6_nxt = static_cast<std::uint8_t>(iana::protocol_number::icmp6);
-        ret = icmp(iov, b, Inner{});
+        ret = icmp(iov, b, header, Inner{});
+        // ICMP is always fully checksummed.
+        if (vnet) { vnet->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM; }
         temporary_show_detail("icmp", "icmp6", ip, src, dst);
         break;
 
       case iana::protocol_number::tcp:
-        ret = generic<tag::tcp>(iov, b);
+        ret = generic<tag::tcp>(iov, b, vnet, Inner{});
         temporary_show_detail("tcp over ip", "tcp over ipv6", ip, src, dst);
         break;
 
       case iana::protocol_number::udp:
-        ret = generic<tag::udp>(iov, b);
+        ret = generic<tag::udp>(iov, b, vnet, Inner{});
         temporary_show_detail("udp over ip", "udp over ipv6", ip, src, dst);
         break;
 
@@ -365,12 +474,61 @@ core(iov_ip6 (&iov)[N], buffer_ref b, const in6_addr &src, const in6_addr &dst,
     return ret;
 }
 
+// Rewrite GSO state for translated packet, whose header is longer than the
+// original one by `grow` bytes.
+void
+translate_offload(virtio_net_hdr &vnet, std::size_t grow)
+{
+    const auto ecn = vnet.gso_type & VIRTIO_NET_HDR_GSO_ECN;
+    switch (vnet.gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
+    {
+      case VIRTIO_NET_HDR_GSO_NONE:
+        break;
+
+      case VIRTIO_NET_HDR_GSO_TCPV4:
+        vnet.gso_type = VIRTIO_NET_HDR_GSO_TCPV6 | ecn;
+        // Segments should be fit in same MTU as the original ones.
+        vnet.gso_size -= grow;
+        vnet.hdr_len  += grow;
+        break;
+
+      default:
+        translate_break("drop unsupported GSO packet");
+    }
+}
+
+// Header for the address pair of `ip`, which is cached for each thread by
+// stateless mode.
+const ipv6::header &
+inbound_header(const ipv4::header &ip)
+{
+    static thread_local flow_cache<in_addr, ipv6::header> cache;
+
+    if (auto h = cache.find(source(ip), dest(ip))) { return *h; }
+
+    std::uint32_t pref;
+    binding_stamp stamp;
+    const auto dst = lookup(dest(ip), pref, stamp);
+    const auto src = embedded_address(source(ip), pref);
+    return cache.insert(source(ip), dest(ip), make_header(src, dst), stamp);
+}
+
+// NAPT rewrites ports of each packet, then its header is never cached.
+ipv6::header
+napt_header(buffer_ref b)
+{
+    const auto &ip = *b.data_as<ipv4::header>();
+    std::uint32_t pref;
+    const auto dst = napt_inbound(b, pref);
+    return make_header(embedded_address(source(ip), pref), dst);
+}
+
 } // shinano::<anonymous-namespace>
 
 // v4 to v6
 template <>
 bool
-translate<ipv6>(std::reference_wrapper<raw> fwd, buffer_ref b) try
+translate<ipv6>(std::reference_wrapper<egress> fwd, buffer_ref b, virtio_net_hdr *vnet) try
 {
     auto &ip = *b.data_as<ipv4::header>();
 
@@ -393,10 +551,11 @@ translate<ipv6>(std::reference_wrapper<raw> fwd, buffer_ref b) try
 
     iov_ip6 iov_ip6[count] = {};
 
-    auto srcv6 = make_embedded_address(source(ip), temporary_prefix(), temporary_plen());
-    auto dstv6 = lookup(dest(ip));
+    const auto header = napt_enabled() ? napt_header(b) : inbound_header(ip);
+    const auto dstv6  = header.ip6_dst;
 
-    const auto iov_cnt = core(iov_ip6, b, srcv6, dstv6, false_{});
+    const auto iov_cnt = core(iov_ip6, b, header, vnet, false_{});
+    if (vnet) { translate_offload(*vnet, iov_ip6[0].len - length(ip)); }
 
     iovec iov[count] = {};
     for (std::size_t i = 0; i < count; ++i)
@@ -405,11 +564,15 @@ translate<ipv6>(std::reference_wrapper<raw> fwd, buffer_ref b) try
         iov[i].iov_len  = iov_ip6[i].iov_len;
     }
 
-    fwd.get().sendmsg(iov, iov_cnt, designated((sockaddr_in6)) by
+    // NOTE: The original header is overwritten from here.
+    std::size_t headroom;
+    const auto cnt = rewrite_in_place(iov, iov_cnt, b, headroom);
+
+    fwd.get().forward(iov, cnt, designated((sockaddr_in6)) by
     (
       ((.sin6_family = AF_INET6))
       ((.sin6_addr   = dstv6))
-    ));
+    ), vnet, headroom);
 
     return true;
 }
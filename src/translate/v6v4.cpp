@@ -3,6 +3,7 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <algorithm>
 #include <iostream>
 #include <cstdint>
 
@@ -14,6 +15,9 @@
 #include "translate.hpp"
 #include "translate/address_table.hpp"
 #include "translate/checksum.hpp"
+#include "translate/flow_cache.hpp"
+#include "translate/napt.hpp"
+#include "translate/pref64.hpp"
 
 namespace shinano {
 
@@ -39,16 +43,38 @@ struct iov_ip
 using boost::mpl::true_;
 using boost::mpl::false_;
 
+// Translated header except fields taken from each packet, i.e. TTL, protocol,
+// total length and checksum.
+ipv4::header
+make_header(const in_addr &src, const in_addr &dst) noexcept
+{
+    return designated((ipv4::header)) by
+    (
+      ((.ip_v   = 4))
+      ((.ip_hl  = sizeof(ipv4::header) / 4)) // have no option
+      //((.ip_tos = <<unspecified>>))
+      //((.ip_len = <<TBD>>)) // filled once the payload is known
+      //((.ip_id  = <<unspecified>>)) // raw socket fills this field iff 0
+      ((.ip_off = 0)) // fragment is not supported currently
+      //((.ip_ttl = <<per packet>>))
+      //((.ip_p   = <<per packet>>))
+      //((.ip_sum = <<TBD>>)) // filled after ip_len, since egress may not be raw socket
+      ((.ip_src = src))
+      ((.ip_dst = dst))
+    );
+}
+
 template <int N, typename Inner>
 std::size_t
-core(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, const in_addr &dst, Inner);
+core(iov_ip (&iov)[N], buffer_ref b, const ipv4::header &header,
+     virtio_net_hdr *vnet, Inner);
 
 
 template <int N>
 inline std::size_t
 dispatch_core(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, const in_addr &dst, false_)
 {
-    return core(iov, b, src, dst, true_{});
+    return core(iov, b, make_header(src, dst), nullptr, true_{});
 }
 
 template <int N>
@@ -58,10 +84,14 @@ dispatch_core(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, const in_addr
     detail::throw_exception(translate_error("ICMPv6 error message containts ICMPv6 error message"));
 }
 
+bool show_detail = true; // set by temporary_show_detail
+
 void
 temporary_show_detail(const char *from, const char *to,
                       const ipv6::header &iphdr, const in_addr &src, const in_addr &dst)
 {
+    if (!show_detail) { return; }
+
     const auto payload_length = net_to_host(iphdr.ip6_plen);
 
     std::cout
@@ -75,20 +105,60 @@ temporary_show_detail(const char *from, const char *to,
         << std::endl;
 }
 
+// v4 address embedded in `address`, and `pref` is set to its Pref64.
+in_addr
+embedded_address(const in6_addr &address, std::uint32_t &pref)
+{
+    pref = pref64_match(address);
+    if (pref == pref64_none) { detail::throw_exception(translate_error("translate v6 to v4 failed: out of any Pref64")); }
+
+    const auto &p = pref64_at(pref);
+    return extract_embedded_address(address, p.prefix, p.plen);
+}
+
+// `host` is translated source of the error message, i.e. the host which
+// received the packet in the body.
 template <int N, typename Inner>
 std::size_t
-reassemble_icmp6_error_body(iov_ip (&iov)[N], buffer_ref b, Inner)
+reassemble_icmp6_error_body(iov_ip (&iov)[N], buffer_ref b, const in_addr &host, Inner)
 {
     auto be6 = b.next_to<ipv6::icmp6_header>();
     auto &ip6 = *be6.data_as<ipv6::header>();
-    auto srcv4 = extract_embedded_address(source(ip6), temporary_prefix(), temporary_plen());
-    auto dstv4 = lookup(dest(ip6));
+    std::uint32_t pref;
+    auto srcv4 = embedded_address(source(ip6), pref);
+    // NAPT binding is shared, then can't be found by the address alone.
+    auto dstv4 = napt_enabled() ? host : lookup(dest(ip6));
     return dispatch_core(iov, be6, srcv4, dstv4, Inner{});
 }
 
+template <int N>
+std::uint16_t
+icmp_checksum(iov_ip (&iov)[N], const ipv6::header &, const ipv6::icmp6_header &, false_) noexcept
+{
+    return ~detail::i_ccs<1>(iov);
+}
+
+// Quoted query may be cut off, then its checksum is adjusted for the pseudo
+// header and the type alone.
+template <int N>
+std::uint16_t
+icmp_checksum(iov_ip (&iov)[N], const ipv6::header &ip6, const ipv6::icmp6_header &icmp6, true_) noexcept
+{
+    const auto ph = designated((ipv6::pseudo_header)) by
+    (
+      ((.pip6_src  = ip6.ip6_src))
+      ((.pip6_dst  = ip6.ip6_dst))
+      ((.pip6_plen = host_to_net<std::uint32_t>(plength(ip6))))
+      ((.pip6_nxt  = ip6.ip6_nxt))
+    );
+    const auto sum = detail::adjust(icmp6.icmp6_cksum, detail::ccs_of(ph), 0);
+    return detail::adjust(sum, *reinterpret_cast<const std::uint16_t *>(&icmp6),
+                          *reinterpret_cast<const std::uint16_t *>(&iov[1].icmp));
+}
+
 template <int N, typename Inner>
 std::size_t
-icmp6(iov_ip (&iov)[N], buffer_ref b, Inner)
+icmp6(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, Inner)
 {
     auto &ip6   = *b.data_as<ipv6::header>();
     auto bip6   = b.next_to<ipv6::header>();
@@ -109,13 +179,13 @@ icmp6(iov_ip (&iov)[N], buffer_ref b, Inner)
       case iana::icmp6_type::echo_request:
         iov[1].icmp.type = static_cast<std::uint8_t>(iana::icmp_type::echo_request);
         iov[2].base      = bip6.next_to<ipv6::icmp6_header>().data();
-        iov[2].len       = plength(ip6) - iov[1].len;
+        iov[2].len       = std::min(plength(ip6), bip6.size()) - iov[1].len;
         break;
 
       case iana::icmp6_type::echo_reply:
         iov[1].icmp.type = static_cast<std::uint8_t>(iana::icmp_type::echo_reply);
         iov[2].base      = bip6.next_to<ipv6::icmp6_header>().data();
-        iov[2].len       = plength(ip6) - iov[1].len;
+        iov[2].len       = std::min(plength(ip6), bip6.size()) - iov[1].len;
         break;
 
       // ICMPv6 error message
@@ -130,17 +200,17 @@ icmp6(iov_ip (&iov)[N], buffer_ref b, Inner)
           case iana::icmp6::destination_unreachable::beyond_scope_of_source:
           case iana::icmp6::destination_unreachable::address:
             iov[1].icmp.code = static_cast<std::uint8_t>(destination_unreachable::host);
-            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, Inner{});
+            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, src, Inner{});
             break;
 
           case iana::icmp6::destination_unreachable::administratively_prohibited:
             iov[1].icmp.code = static_cast<std::uint8_t>(destination_unreachable::host_is_a14y_prohibited);
-            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, Inner{});
+            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, src, Inner{});
             break;
 
           case iana::icmp6::destination_unreachable::port:
             iov[1].icmp.code = static_cast<std::uint8_t>(destination_unreachable::port);
-            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, Inner{});
+            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, src, Inner{});
             break;
 
           default:
@@ -151,13 +221,13 @@ icmp6(iov_ip (&iov)[N], buffer_ref b, Inner)
       case iana::icmp6_type::packet_too_big:
         iov[1].icmp.type = static_cast<std::uint8_t>(iana::icmp_type::destination_unreachable);
         iov[1].icmp.code = static_cast<std::uint8_t>(iana::icmp::destination_unreachable::fragmentation_needed);
-        count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, Inner{});
+        count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, src, Inner{});
         break;
 
       case iana::icmp6_type::time_exceeded:
         iov[1].icmp.type = static_cast<std::uint8_t>(iana::icmp_type::time_exceeded);
         iov[1].icmp.code = icmp6.icmp6_code;
-        count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, Inner{});
+        count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, src, Inner{});
         break;
 
       case iana::icmp6_type::parameter_problem:
@@ -192,7 +262,7 @@ icmp6(iov_ip (&iov)[N], buffer_ref b, Inner)
 
           case iana::icmp6::parameter_problem::next_header:
             iov[1].icmp.code = static_cast<std::uint8_t>(iana::icmp::destination_unreachable::protocol);
-            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, Inner{});
+            count = count - 1 + reassemble_icmp6_error_body(drop<2>(iov), bip6, src, Inner{});
             break;
 
           case iana::icmp6::parameter_problem::option:
@@ -208,14 +278,14 @@ icmp6(iov_ip (&iov)[N], buffer_ref b, Inner)
         detail::throw_exception(translate_error("unknown ICMPv6 type"));
     }
 
-    checksum_field(iov[1].icmp) = ~detail::i_ccs<1>(iov);
+    checksum_field(iov[1].icmp) = icmp_checksum(iov, ip6, icmp6, Inner{});
 
     return count;
 }
 
 template <typename Tag, int N>
 std::size_t
-generic(iov_ip (&iov)[N], buffer_ref b)
+generic(iov_ip (&iov)[N], buffer_ref b, virtio_net_hdr *vnet, false_)
 {
     auto bip6  = b.next_to<ipv6::header>();
 
@@ -234,6 +304,16 @@ generic(iov_ip (&iov)[N], buffer_ref b)
     iovec piov[2];
     piov[0].iov_base = const_cast<void *>(static_cast<const void *>(&ph));
     piov[0].iov_len  = sizeof(ph);
+    if (vnet)
+    {
+        // Sum up pseudo header only. Payload is never touched; the kernel or
+        // NIC completes the checksum.
+        vnet->flags       = (vnet->flags & ~VIRTIO_NET_HDR_F_DATA_VALID) | VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet->csum_start  = iov[0].len;
+        vnet->csum_offset = checksum_offset<Tag>();
+        checksum_field<Tag>(iov[1].base) = detail::ccs(piov[0]);
+        return 2;
+    }
     piov[1].iov_base = iov[1].iov_base;
     piov[1].iov_len  = iov[1].iov_len;
 
@@ -242,26 +322,49 @@ generic(iov_ip (&iov)[N], buffer_ref b)
     return 2;
 }
 
-template <int N, typename Inner>
+// Quoted packet may be cut off, then its checksum is adjusted for the pseudo
+// header alone, instead of summed up again.
+template <typename Tag, int N>
 std::size_t
-core(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, const in_addr &dst, Inner)
+generic(iov_ip (&iov)[N], buffer_ref b, virtio_net_hdr *, true_)
 {
-    auto &ip6 = *b.data_as<ipv6::header>();
+    const auto &ip6 = *b.data_as<ipv6::header>();
+    auto bip6 = b.next_to<ipv6::header>();
+
+    iov[1].base = bip6.data();
+    iov[1].len  = bip6.size();
 
-    iov[0].ip = designated((ipv4::header)) by
+    const auto from = designated((ipv6::pseudo_header)) by
     (
-      ((.ip_v   = 4))
-      ((.ip_hl  = sizeof(ipv4::header) / 4)) // have no option
-      //((.ip_tos = <<unspecified>>))
-      //((.ip_len = <<TBD>>)) // kernel fill this field iff 0
-      //((.ip_id  = <<unspecified>>)) // kernel fill this field iff 0
-      ((.ip_off = 0)) // fragment is not supported currently
-      ((.ip_ttl = ip6.ip6_hlim))
-      ((.ip_p   = ip6.ip6_nxt))
-      //((.ip_sum = <<unspecified>>)) // kernel always calc checksum
-      ((.ip_src = src))
-      ((.ip_dst = dst))
+      ((.pip6_src  = ip6.ip6_src))
+      ((.pip6_dst  = ip6.ip6_dst))
+      ((.pip6_plen = host_to_net<std::uint32_t>(plength(ip6))))
+      ((.pip6_nxt  = ip6.ip6_nxt))
+    );
+    const auto to = designated((ipv4::pseudo_header)) by
+    (
+      ((.pip_src   = iov[0].ip.ip_src))
+      ((.pip_dst   = iov[0].ip.ip_dst))
+      ((.pip_proto = iov[0].ip.ip_p))
+      ((.pip_len   = host_to_net<std::uint16_t>(plength(ip6))))
     );
+    detail::adjust<Tag>(iov[1].base, iov[1].len, detail::ccs_of(from), detail::ccs_of(to));
+
+    return 2;
+}
+
+template <int N, typename Inner>
+std::size_t
+core(iov_ip (&iov)[N], buffer_ref b, const ipv4::header &header,
+     virtio_net_hdr *vnet, Inner)
+{
+    auto &ip6 = *b.data_as<ipv6::header>();
+    const auto &src = header.ip_src;
+    const auto &dst = header.ip_dst;
+
+    iov[0].ip = header;
+    iov[0].ip.ip_ttl = ip6.ip6_hlim;
+    iov[0].ip.ip_p   = ip6.ip6_nxt;
     iov[0].len = length(iov[0].ip);
 
     std::size_t ret = 0;
@@ -270,17 +373,19 @@ core(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, const in_addr &dst, Inn
       case iana::protocol_number::icmp6:
         // Adjust next-header field for ICMP
         iov[0].ip.ip_p = static_cast<std::uint8_t>(iana::protocol_number::icmp);
-        ret = icmp6(iov, b, Inner{});
+        ret = icmp6(iov, b, src, Inner{});
+        // ICMP is always fully checksummed.
+        if (vnet) { vnet->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM; }
         temporary_show_detail("icmp6", "icmp", ip6, src, dst);
         break;
 
       case iana::protocol_number::tcp:
-        ret = generic<tag::tcp>(iov, b);
+        ret = generic<tag::tcp>(iov, b, vnet, Inner{});
         temporary_show_detail("tcp over ipv6", "tcp over ip", ip6, src, dst);
         break;
 
       case iana::protocol_number::udp:
-        ret = generic<tag::udp>(iov, b);
+        ret = generic<tag::udp>(iov, b, vnet, Inner{});
         temporary_show_detail("udp over ipv6", "udp over ip", ip6, src, dst);
         break;
 
@@ -288,15 +393,84 @@ core(iov_ip (&iov)[N], buffer_ref b, const in_addr &src, const in_addr &dst, Inn
         translate_break("drop unsupported packet", false);
     }
 
+    // Header of quoted packet keeps the length which the host sent.
+    if (Inner::value)
+    {
+        iov[0].ip.ip_len = host_to_net<std::uint16_t>(iov[0].len + plength(ip6));
+        iov[0].ip.ip_sum = ~detail::ccs(iov[0]);
+    }
+
     return ret;
 }
 
+// Rewrite GSO state for translated packet, whose header is shorter than the
+// original one by `shrink` bytes.
+void
+translate_offload(virtio_net_hdr &vnet, std::size_t shrink)
+{
+    const auto ecn = vnet.gso_type & VIRTIO_NET_HDR_GSO_ECN;
+    switch (vnet.gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
+    {
+      case VIRTIO_NET_HDR_GSO_NONE:
+        break;
+
+      case VIRTIO_NET_HDR_GSO_TCPV6:
+        // Segments become shorter, then keep gso_size as is.
+        vnet.gso_type = VIRTIO_NET_HDR_GSO_TCPV4 | ecn;
+        vnet.hdr_len -= shrink;
+        break;
+
+      default:
+        translate_break("drop unsupported GSO packet");
+    }
+}
+
+// Header for the address pair of `ip6`, which is cached for each thread by
+// stateless mode.
+const ipv4::header &
+outbound_header(const ipv6::header &ip6)
+{
+    static thread_local flow_cache<in6_addr, ipv4::header> cache;
+
+    if (auto h = cache.find(source(ip6), dest(ip6))) { return *h; }
+
+    // Unknown destination never binds the source.
+    std::uint32_t pref;
+    const auto dst = embedded_address(dest(ip6), pref);
+
+    binding_stamp stamp;
+    const auto src = lookup(source(ip6), pref, stamp);
+    return cache.insert(source(ip6), dest(ip6), make_header(src, dst), stamp);
+}
+
+// NAPT rewrites ports of each packet, then its header is never cached.
+ipv4::header
+napt_header(buffer_ref b)
+{
+    const auto &ip6 = *b.data_as<ipv6::header>();
+    std::uint32_t pref;
+    const auto dst = embedded_address(dest(ip6), pref);
+    return make_header(napt_outbound(b, pref), dst);
+}
+
 } // namespace shinano::<anonymous-namespace>
 
+void
+temporary_show_detail(bool show) noexcept
+{
+    show_detail = show;
+}
+
+bool
+temporary_show_detail() noexcept
+{
+    return show_detail;
+}
+
 // v6 to v4
 template <>
 bool
-translate<ipv4>(std::reference_wrapper<raw> fwd, buffer_ref b) try
+translate<ipv4>(std::reference_wrapper<egress> fwd, buffer_ref b, virtio_net_hdr *vnet) try
 {
     auto &ip6 = *b.data_as<ipv6::header>();
 
@@ -319,10 +493,11 @@ translate<ipv4>(std::reference_wrapper<raw> fwd, buffer_ref b) try
 
     iov_ip iov_ip[count] = {};
 
-    auto srcv4 = lookup(source(ip6));
-    auto dstv4 = extract_embedded_address(dest(ip6), temporary_prefix(), temporary_plen());
+    const auto header = napt_enabled() ? napt_header(b) : outbound_header(ip6);
+    const auto dstv4  = header.ip_dst;
 
-    const auto iov_cnt = core(iov_ip, b, srcv4, dstv4, false_{});
+    const auto iov_cnt = core(iov_ip, b, header, vnet, false_{});
+    if (vnet) { translate_offload(*vnet, length(ip6) - iov_ip[0].len); }
 
     iovec iov[count] = {};
     for (std::size_t i = 0; i < count; ++i)
@@ -331,11 +506,23 @@ translate<ipv4>(std::reference_wrapper<raw> fwd, buffer_ref b) try
         iov[i].iov_len  = iov_ip[i].iov_len;
     }
 
-    fwd.get().sendmsg(iov, iov_cnt, designated((sockaddr_in)) by
+    // Kernel fills total length and header checksum only for raw socket, then
+    // fill them here for other egress.
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < iov_cnt; ++i) { total += iov[i].iov_len; }
+    if (total > IP_MAXPACKET) { translate_break("drop too large packet for ipv4"); }
+    iov_ip[0].ip.ip_len = host_to_net<std::uint16_t>(total);
+    iov_ip[0].ip.ip_sum = ~detail::ccs(iov[0]);
+
+    // NOTE: The original header is overwritten from here.
+    std::size_t headroom;
+    const auto cnt = rewrite_in_place(iov, iov_cnt, b, headroom);
+
+    fwd.get().forward(iov, cnt, designated((sockaddr_in)) by
     (
       ((.sin_family = AF_INET))
       ((.sin_addr   = dstv4))
-    ));
+    ), vnet, headroom);
 
     return true;
 }
@@ -0,0 +1,151 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.hpp"
+
+#include "detail/exception.hpp"
+
+namespace shinano {
+
+namespace {
+
+int
+io_uring_setup(unsigned entries, io_uring_params &p) noexcept
+{
+    return ::syscall(__NR_io_uring_setup, entries, &p);
+}
+
+int
+io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) noexcept
+{
+    return ::syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+int
+io_uring_register(int fd, unsigned opcode, const void *arg, unsigned n) noexcept
+{
+    return ::syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+detail::mapping
+map_ring(int fd, std::size_t len, off_t offset)
+{
+    void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (p == MAP_FAILED) { throw_with_errno(); }
+    return detail::mapping(p, detail::unmap_delete{len});
+}
+
+template <typename T>
+T *
+at(const detail::mapping &m, std::uint32_t offset) noexcept
+{
+    return reinterpret_cast<T *>(static_cast<char *>(m.get()) + offset);
+}
+
+} // namespace shinano::<anonymous-namespace>
+
+uring::uring(unsigned entries)
+  : uring(entries, io_uring_params{})
+{
+}
+
+uring::uring(unsigned entries, io_uring_params p)
+  : safe_desc(io_uring_setup(entries, p))
+{
+    auto sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    auto cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_len = cq_len = std::max(sq_len, cq_len);
+    }
+
+    sq_map = map_ring(native(), sq_len, IORING_OFF_SQ_RING);
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_map = map_ring(native(), cq_len, IORING_OFF_CQ_RING);
+    }
+    const auto &cq_base = cq_map ? cq_map : sq_map;
+    sqe_map = map_ring(native(), p.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+
+    sq_head    = at<unsigned>(sq_map, p.sq_off.head);
+    sq_tail    = at<unsigned>(sq_map, p.sq_off.tail);
+    sq_mask    = *at<unsigned>(sq_map, p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sqes       = static_cast<io_uring_sqe *>(sqe_map.get());
+
+    // SQE index is always same as its position on the ring.
+    auto array = at<unsigned>(sq_map, p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) { array[i] = i; }
+    sqe_head = sqe_tail = *sq_tail;
+
+    cq_head = at<unsigned>(cq_base, p.cq_off.head);
+    cq_tail = at<unsigned>(cq_base, p.cq_off.tail);
+    cq_mask = *at<unsigned>(cq_base, p.cq_off.ring_mask);
+    cqes    = at<io_uring_cqe>(cq_base, p.cq_off.cqes);
+}
+
+void
+uring::register_files(const int *fds, unsigned n)
+{
+    if (io_uring_register(native(), IORING_REGISTER_FILES, fds, n) < 0) { throw_with_errno(); }
+}
+
+void
+uring::register_buffers(const iovec *iov, unsigned n)
+{
+    if (io_uring_register(native(), IORING_REGISTER_BUFFERS, iov, n) < 0) { throw_with_errno(); }
+}
+
+io_uring_sqe *
+uring::get_sqe() noexcept
+{
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) { return nullptr; }
+
+    auto sqe = &sqes[sqe_tail++ & sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void
+uring::submit(unsigned wait)
+{
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+    const unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    while (true)
+    {
+        const int err = io_uring_enter(native(), sqe_tail - sqe_head, wait, flags);
+        if (err < 0)
+        {
+            if (errno == EINTR) { continue; }
+            throw_with_errno();
+        }
+        sqe_head += err;
+        return;
+    }
+}
+
+io_uring_cqe *
+uring::peek_cqe() noexcept
+{
+    const auto head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) { return nullptr; }
+    return &cqes[head & cq_mask];
+}
+
+void
+uring::cqe_seen() noexcept
+{
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+} // namespace shinano
@@ -0,0 +1,68 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_uring_hpp_
+#define shinano_uring_hpp_
+
+#include <cstdint>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "socket.hpp"
+#include "detail/memory.hpp"
+
+namespace shinano {
+
+// Minimal io_uring instance, which is driven by single thread.
+struct uring : detail::safe_desc
+{
+    explicit
+    uring(unsigned entries);
+
+    // Registered descriptors are referred by index with IOSQE_FIXED_FILE.
+    void
+    register_files(const int *fds, unsigned n);
+
+    // Registered buffers are referred by index with *_FIXED operations.
+    void
+    register_buffers(const iovec *iov, unsigned n);
+
+    // Returns zero-cleared SQE, or nullptr if submission queue is full.
+    io_uring_sqe *
+    get_sqe() noexcept;
+
+    // Submit queued SQEs, and wait for at least `wait` completions.
+    void
+    submit(unsigned wait = 0);
+
+    // Returns nullptr if no completion is available.
+    io_uring_cqe *
+    peek_cqe() noexcept;
+
+    void
+    cqe_seen() noexcept;
+
+private:
+    uring(unsigned entries, io_uring_params p);
+
+    detail::mapping sq_map, cq_map, sqe_map;
+
+    unsigned *     sq_head;
+    unsigned *     sq_tail;
+    unsigned       sq_mask;
+    unsigned       sq_entries;
+    io_uring_sqe * sqes;
+    unsigned       sqe_head = 0;
+    unsigned       sqe_tail = 0;
+
+    unsigned *     cq_head;
+    unsigned *     cq_tail;
+    unsigned       cq_mask;
+    io_uring_cqe * cqes;
+};
+
+} // namespace shinano
+
+#endif
@@ -8,8 +8,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "util.hpp"
+#include "translate.hpp"
 
+#include <algorithm>
 #include <array>
+#include <iterator>
+#include <stdexcept>
 #include <string>
 
 namespace shinano {
@@ -55,14 +59,14 @@ to_string(const in6_addr &addr)
 //    NOTE: The `r` field is reserved and should be zero. And the suf(a.k.a suffix)
 //          is reserved for future purpose and should be zero. RFC6052 also says the
 //          translator should ignore such field even if not zero.
+//
+// Octets are copied as they are, then no care of byte order is needed.
 
-in_addr
-extract_embedded_address(const in6_addr &embed, const in6_addr &prefix, std::size_t plen)
-{
-    in_addr x;
-
-    // TODO: Check that prefix is match.
+namespace {
 
+void
+check_plen(std::size_t plen)
+{
     switch (plen)
     {
       case 32:
@@ -70,46 +74,57 @@ extract_embedded_address(const in6_addr &embed, const in6_addr &prefix, std::siz
       case 48:
       case 56:
       case 64:
-        // TODO: Implement for above prefix length.
-        detail::throw_exception(std::runtime_error("foo"));
-
       case 96:
-        // TODO: Take care of byte endian.
-        // x.s_addr = embed.s6_addr32[0]; for BIG-endian
-        x.s_addr = embed.s6_addr32[3];
-        return x;
+        return;
 
       default:
-        // FIXME: Should throw eligible exception object.
-        detail::throw_exception(std::runtime_error("bar"));
+        detail::throw_exception(std::runtime_error("Pref64 should be /32, /40, /48, /56, /64 or /96"));
+    }
+}
+
+// Position of i-th octet of v4 address, which skips the `r` octet.
+std::size_t
+embedded_octet(std::size_t plen, std::size_t i) noexcept
+{
+    const auto at = plen / 8 + i;
+    return at < 8 || plen > 64 ? at : at + 1;
+}
+
+} // namespace shinano::<anonymous-namespace>
+
+in_addr
+extract_embedded_address(const in6_addr &embed, const in6_addr &prefix, std::size_t plen)
+{
+    check_plen(plen);
+    if (!std::equal(prefix.s6_addr, prefix.s6_addr + plen / 8, embed.s6_addr))
+    {
+        detail::throw_exception(translate_error("translate v6 to v4 failed: out of the Pref64"));
     }
+
+    in_addr x;
+    auto octets = reinterpret_cast<std::uint8_t *>(&x.s_addr);
+    for (std::size_t i = 0; i < sizeof(x.s_addr); ++i)
+    {
+        octets[i] = embed.s6_addr[embedded_octet(plen, i)];
+    }
+    return x;
 }
 
 in6_addr
 make_embedded_address(const in_addr &x, const in6_addr &prefix, std::size_t plen)
 {
+    check_plen(plen);
+
+    // The `r` octet and the suffix are zero.
     in6_addr embed = prefix;
+    std::fill(std::begin(embed.s6_addr) + plen / 8, std::end(embed.s6_addr), 0);
 
-    switch (plen)
+    auto octets = reinterpret_cast<const std::uint8_t *>(&x.s_addr);
+    for (std::size_t i = 0; i < sizeof(x.s_addr); ++i)
     {
-      case 32:
-      case 40:
-      case 48:
-      case 56:
-      case 64:
-        // TODO: Implement for above prefix length.
-        detail::throw_exception(std::runtime_error("foo"));
-
-      case 96:
-        // TODO: Take care of byte endian.
-        // embed.s6_addr32[0] = embed.s_addr; for BIG-endian
-        embed.s6_addr32[3] = x.s_addr;
-        return embed;
-
-      default:
-        // FIXME: Should throw eligible exception object.
-        detail::throw_exception(std::runtime_error("bar"));
+        embed.s6_addr[embedded_octet(plen, i)] = octets[i];
     }
+    return embed;
 }
 
 } // namespace shinano
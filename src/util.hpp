@@ -92,6 +92,15 @@ checksum_field(T *h) noexcept
     return checksum_field(*reinterpret_cast<typename Tag::header *>(h));
 }
 
+// Offset of the checksum field from head of the header.
+template <typename Tag>
+inline std::size_t
+checksum_offset() noexcept
+{
+    typename Tag::header h;
+    return reinterpret_cast<char *>(&checksum_field(h)) - reinterpret_cast<char *>(&h);
+}
+
 
 in_addr
 extract_embedded_address(const in6_addr &embed, const in6_addr &prefix, std::size_t plen);
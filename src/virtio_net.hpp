@@ -0,0 +1,45 @@
+//          Copyright Kohei Takahashi 2014
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef shinano_virtio_net_hpp_
+#define shinano_virtio_net_hpp_
+
+#include <cstdint>
+
+namespace shinano {
+
+// Legacy virtio_net_hdr as exchanged with TUN/TAP by IFF_VNET_HDR. Since
+// <linux/virtio_net.h> is not valid C++, the definitions are mirrored here.
+// Fields are in host byte order unless TUNSETVNETLE/BE is set.
+struct virtio_net_hdr
+{
+    std::uint8_t  flags;
+    std::uint8_t  gso_type;
+    std::uint16_t hdr_len;     // Ethernet + IP + L4 header length
+    std::uint16_t gso_size;    // bytes to append to hdr_len per segment
+    std::uint16_t csum_start;  // position to start checksumming from
+    std::uint16_t csum_offset; // offset after that to place checksum
+};
+static_assert(sizeof(virtio_net_hdr) == 10, "size of virtio_net_hdr should be 10");
+
+enum : std::uint8_t
+{
+    VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
+    VIRTIO_NET_HDR_F_DATA_VALID = 2,
+};
+
+enum : std::uint8_t
+{
+    VIRTIO_NET_HDR_GSO_NONE   = 0,
+    VIRTIO_NET_HDR_GSO_TCPV4  = 1,
+    VIRTIO_NET_HDR_GSO_UDP    = 3,
+    VIRTIO_NET_HDR_GSO_TCPV6  = 4,
+    VIRTIO_NET_HDR_GSO_UDP_L4 = 5,
+    VIRTIO_NET_HDR_GSO_ECN    = 0x80,
+};
+
+} // namespace shinano
+
+#endif